@@ -2,13 +2,73 @@
 // Created by Artemii Kazakov, ITMO.
 //
 
+#if !defined(_WIN32) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include "errors.h"
 #include "return_codes.h"
 
+#include <limits.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#if defined(_WIN32)
+
+#include <fcntl.h>
+#include <io.h>
+#include <process.h>
+#include <windows.h>
+
+#else
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+
+#define HAVE_SSE2
+#include <emmintrin.h>
+
+#if defined(_MSC_VER)
+
+#define HAVE_X86_DISPATCH
+#define TARGET_SSSE3
+#define TARGET_AVX2
+#define TARGET_AVX512_VBMI
+#include <immintrin.h>
+#include <intrin.h>
+
+#elif defined(__GNUC__) || defined(__clang__)
+
+#define HAVE_X86_DISPATCH
+#define TARGET_SSSE3 __attribute__((target("ssse3")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512_VBMI __attribute__((target("avx512f,avx512bw,avx512vbmi")))
+#include <immintrin.h>
+
+#endif
+
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+
+#define HAVE_NEON
+#include <arm_neon.h>
+
+#endif
 
 #if defined(ZLIB)
 
@@ -26,6 +86,18 @@
 
 // ---- MACROS ----
 #define ARR(NAME, X, Y, N) NAME[(((X) * (N)) + (Y))]
+#define IOV_BATCH 64
+#define ADAM7_PASSES 7
+#define ADAM7_TILE 256
+#define GRAY_SELECT_MAX_KEYS 4
+#define MAX_COLOR_KEYS 64
+#define MAX_THREADS 64
+#define MAX_HEADER 128
+#define DIRECT_ALIGN 4096
+#define WRITE_QUEUE_BANDS 8
+#define RING_SLOTS 64
+#define TAR_BLOCK 512
+#define TAR_NAME_SIZE 256
 
 // ---- CONSTS ----
 const int COUNT_CHUNK_TYPES = 7;
@@ -34,6 +106,32 @@ const char PNG_CHUNKS_SIGNATURE[6][4] = {
 	{ 0x49, 0x48, 0x44, 0x52 }, { 0x49, 0x44, 0x41, 0x54 }, { 0x49, 0x45, 0x4e, 0x44 },
 	{ 0x50, 0x4c, 0x54, 0x45 }, { 0x74, 0x52, 0x4e, 0x53 }, { 0x62, 0x4b, 0x47, 0x44 }
 };
+const unsigned int ADAM7_X0[ADAM7_PASSES] = { 0, 4, 0, 2, 0, 1, 0 };
+const unsigned int ADAM7_Y0[ADAM7_PASSES] = { 0, 0, 4, 0, 2, 0, 1 };
+const unsigned int ADAM7_DX[ADAM7_PASSES] = { 8, 8, 4, 4, 2, 2, 1 };
+const unsigned int ADAM7_DY[ADAM7_PASSES] = { 8, 8, 8, 4, 4, 2, 2 };
+const unsigned int PREVIEW_SX[ADAM7_PASSES] = { 8, 4, 4, 2, 2, 1, 1 };
+const unsigned int PREVIEW_SY[ADAM7_PASSES] = { 8, 8, 4, 4, 2, 2, 1 };
+const unsigned long PARALLEL_UNFILTER_MIN_BYTES = 1 << 16;
+const unsigned long CONVERT_BAND_BYTES = 1 << 18;
+const unsigned long DIRECT_BUFFER_BYTES = 1 << 20;
+const char RING_MAGIC[8] = { 'P', 'N', 'G', 'R', 'I', 'N', 'G', '1' };
+const int RING_STALL_SECONDS = 30;
+const char *const PAM_TUPLE_TYPES[4] = { "GRAYSCALE", "GRAYSCALE_ALPHA", "RGB", "RGB_ALPHA" };
+
+// RGB_INTERLEAVE[n][c] picks the channel c bytes of output block n when 16 planar R, G, B
+// vectors are interleaved into 48 bytes of RGB.
+const signed char RGB_INTERLEAVE[3][3][16] = {
+	{ { 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5 },
+	  { -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1 },
+	  { -1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1 } },
+	{ { -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1 },
+	  { 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10 },
+	  { -1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1 } },
+	{ { -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1 },
+	  { -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1 },
+	  { 10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15 } }
+};
 
 // ---- STRUCTURES ----
 enum filter_type
@@ -63,13 +161,286 @@ struct chunk
 	char *data;
 };
 
+enum cpu_feature
+{
+	CPU_SSSE3,
+	CPU_AVX2,
+	CPU_AVX512_VBMI
+};
+
+// Composited palette: RGBX entries (X = tRNS alpha, ignored by the RGB kernels) for 4-byte loads
+// and gathers, and the same colors as R, G and B planes for byte-permute lookups. Entries past
+// `size` are black. For PAM output the colors are kept as they are and X is the alpha channel.
+struct palette
+{
+	unsigned char rgbx[256][4];
+	unsigned char planes[3][256];
+	unsigned int size;
+};
+
+// Gray output for every 8-bit gray value: the value itself, or the background for tRNS keys.
+// `changed` lists the values that do not map to themselves; `alpha` is 0 for the keys and 255
+// otherwise, for PAM output.
+struct gray_table
+{
+	unsigned char map[256];
+	unsigned char alpha[256];
+	unsigned char changed[256];
+	unsigned int changed_count;
+};
+
+// RGB tRNS keys that fit the 8-bit range.
+struct color_keys
+{
+	unsigned char keys[MAX_COLOR_KEYS][3];
+	unsigned int count;
+};
+
+// Everything a row converter needs, prepared once per image: only the table matching the
+// selected converter is filled in.
+struct conversion
+{
+	unsigned char background[3];
+	struct palette palette;
+	struct gray_table gray;
+	struct color_keys keys;
+};
+
+typedef void (*row_kernel)(const unsigned char *, unsigned char *, unsigned int, const struct conversion *);
+
+// --npy element type and layout. float32 elements are x * scale[c] + bias[c] for channel c, that
+// is x / 255 normalized with --mean and --std.
+struct tensor_format
+{
+	int chw;
+	int float32;
+	float scale[4];
+	float bias[4];
+};
+
+struct options
+{
+	int preview_pass;
+	int keep_16bit;
+	int threads;
+	int keep_alpha;
+	int auto_gray;
+	int mmap_output;
+	const char *memfd_target;
+	int direct_io;
+	int sparse;
+	int write_behind;
+	int ring;
+	const char *tar_path;
+	const char *tar_input;
+	int npy;
+	struct tensor_format tensor;
+};
+
+struct thread_task
+{
+	void *(*func)(void *);
+	void *arg;
+#if defined(_WIN32)
+	HANDLE handle;
+#else
+	pthread_t handle;
+#endif
+};
+
+// Mutex and condition variable pair for tasks that hand work to each other.
+struct task_signal
+{
+#if defined(_WIN32)
+	CRITICAL_SECTION lock;
+	CONDITION_VARIABLE changed;
+#else
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+#endif
+};
+
+// `rows` rows of row_len bytes, `stride` bytes apart, ready to be written as they are.
+struct row_band
+{
+	const char *data;
+	unsigned long row_len;
+	unsigned long stride;
+	unsigned int rows;
+};
+
+// Bounded queue of finished bands between the converter and the write-behind task, which writes
+// them to `output` in order. After the first write error the remaining bands are dropped.
+// Conversion threads finish bands out of order: `ready` flags the converted ones and the thread
+// that finds the oldest missing band (next_band) ready pushes the run of ready bands from it.
+struct band_queue
+{
+	struct row_band bands[WRITE_QUEUE_BANDS];
+	unsigned int head;
+	unsigned int count;
+	int closed;
+	int error;
+	unsigned char *ready;
+	unsigned int ready_bands;
+	unsigned int next_band;
+	int pushing;
+	FILE *output;
+	int started;
+	struct thread_task task;
+	struct task_signal signal;
+};
+
+#if !defined(_WIN32)
+// Start of a --ring shared memory object; RING_SLOTS slots of row_bytes bytes follow at
+// data_offset. Row r goes to slot r % RING_SLOTS, and sequence[slot] is set to r + 1 (release)
+// once the row is there. The consumer reads rows in order and stores how many it has read in
+// `consumed` (release); the producer only reuses a slot after that. `state` is RING_STREAMING
+// once the fields above are valid and ends as RING_DONE or RING_FAILED.
+struct ring_header
+{
+	char magic[8];
+	unsigned int width;
+	unsigned int height;
+	unsigned int depth;
+	unsigned int maxval;
+	unsigned long long row_bytes;
+	unsigned long long data_offset;
+	unsigned int slots;
+	atomic_uint state;
+	atomic_ullong consumed;
+	atomic_ullong sequence[RING_SLOTS];
+};
+#endif
+
+enum ring_state
+{
+	RING_STARTING,
+	RING_STREAMING,
+	RING_DONE,
+	RING_FAILED
+};
+
+// Producer side of a --ring: the mapping of the shared memory object. `failed` is set once the
+// consumer has stopped reading, after which no more rows are published.
+struct row_ring
+{
+	struct ring_header *header;
+	unsigned char *slots;
+	unsigned long row_bytes;
+	unsigned long size;
+	int failed;
+};
+
+// One pwrite of a filled direct_writer buffer, run by the writer task. A sparse write skips the
+// DIRECT_ALIGN blocks that are all zero, leaving holes in the file.
+struct direct_write
+{
+	int fd;
+	const char *data;
+	unsigned long len;
+	unsigned long offset;
+	int sparse;
+	int error;
+};
+
+// Output written around the page cache (O_DIRECT, or F_NOCACHE where there is no O_DIRECT) from
+// two DIRECT_ALIGN-aligned buffers of DIRECT_BUFFER_BYTES: one is filled while a long-lived task
+// writes the other (`queued` while the task owns `job`). The last block is written zero-padded
+// and the file is cut back to `size` on close. The same writer without the cache bypass serves
+// --sparse.
+struct direct_writer
+{
+	int fd;
+	int sparse;
+	char *buffers[2];
+	int current;
+	unsigned long used;
+	unsigned long offset;
+	unsigned long size;
+	int queued;
+	int closed;
+	int started;
+	int error;
+	struct direct_write job;
+	struct thread_task task;
+	struct task_signal signal;
+};
+
+// Members of an input tar archive: a file is mapped whole and members point into the mapping, a
+// stream (stdin) is read one member at a time into `buffer`.
+struct tar_reader
+{
+	FILE *stream;
+	const unsigned char *map;
+	unsigned long long map_size;
+	unsigned long long offset;
+	char *buffer;
+	// ustar prefix (155) + '/' + name (100) + '\0'
+	char name[257];
+};
+
+struct unfilter_job
+{
+	unsigned int width;
+	unsigned int height;
+	int bits_pixel;
+	char *data;
+	const unsigned char (*unpack_table)[8];
+	char *unpacked;
+};
+
+// Rows first_band, first_band + band_step, ... (counted in bands of band_rows rows) of a row
+// conversion; each band reads and writes about CONVERT_BAND_BYTES. With a scratch row the whole
+// image is converted back to front instead (in place expansion). `gray` requests a gray scan of
+// the RGB output rows and is cleared by the first row that is not gray.
+struct convert_job
+{
+	row_kernel convert;
+	const struct conversion *conversion;
+	const char *png_data;
+	unsigned char *out;
+	unsigned int width;
+	unsigned int height;
+	int bytes_pixel;
+	int bytes_pixel_out;
+	unsigned int band_rows;
+	unsigned int first_band;
+	unsigned int band_step;
+	unsigned char *scratch;
+	int gray;
+	struct band_queue *queue;
+	struct row_ring *ring;
+	const struct tensor_format *tensor;
+	unsigned char *tensor_row;
+	struct direct_writer *writer;
+	unsigned char *writer_row;
+};
+
 // ---- PROTOTYPES ----
 
 // - MAJOR -
-void write_to_lines(unsigned int, unsigned int, int, int, const char *, char, const unsigned char[3], int *, char **, struct chunk, int, struct chunk);
+int parse_options(int, char *[], struct options *, int *, char *[]);
+
+int parse_channel_values(const char *, float[4]);
+
+const char *output_extension(const struct options *);
+
+int convert_image(struct options, int, char *[], FILE *, FILE *);
+
+int convert_tar_members(struct options, const char *, FILE *);
+
+int write_to_lines(unsigned int, unsigned int, int, int, const char *, char, const unsigned char[3], int *, char **, struct chunk, int, struct chunk, int, int *, int, struct band_queue *, struct row_ring *, const struct tensor_format *, struct direct_writer *);
+
+void *convert_job_run(void *);
+
+void write_to_lines16(unsigned int, unsigned int, int, int, const char *, char, const unsigned short[3], int *, char **, int, struct chunk, int, struct band_queue *);
+
+void make_palette(struct chunk, int, struct chunk, const unsigned char[3], int, struct palette *);
 
 void change_background(int, char **, char, struct chunk, unsigned char[], int *, int, struct chunk);
 
+void change_background16(const unsigned char[3], int, char, int, struct chunk, unsigned short[3]);
+
 int read_all_chunks(FILE *, unsigned long[256], unsigned long *, char **, struct chunk *, int *, int, struct chunk **, const enum chunk_type *, int *);
 
 int read_chunk(FILE *, struct chunk *, const unsigned long *);
@@ -78,6 +449,223 @@ enum chunk_type change_type_chunk(char[4]);
 
 void unfilter_png(unsigned int, unsigned int, int, char *);
 
+void unfilter_packed_png(unsigned int, unsigned int, int, char *);
+
+void make_unpack_table(int, int, unsigned char[256][8]);
+
+void unpack_png(unsigned int, unsigned int, int, const unsigned char[256][8], const char *, char *);
+
+void scale_sample_chunk(int, struct chunk);
+
+void downconvert_png(unsigned int, unsigned int, int, const struct chunk *, char *);
+
+void downconvert_samples(const unsigned char *, unsigned char *, unsigned long);
+
+int deinterlace_png(unsigned int, unsigned int, int, int, const unsigned char[256][8], char **);
+
+void scatter_adam7(unsigned int, unsigned int, int, int, char *const[ADAM7_PASSES], char *);
+
+void subsample_png(unsigned int, unsigned int, int, int, char *);
+
+int is_direct_output(char, int, int);
+
+int pam_depth(char, int);
+
+unsigned long write_rows_direct(FILE *, unsigned int, unsigned int, int, const char *);
+
+// - OUTPUT -
+int format_header(char[MAX_HEADER], unsigned int, unsigned int, int, int, int, int);
+
+void copy_rows_direct(unsigned int, unsigned int, int, const char *, char *);
+
+int map_output(const char *, unsigned long, int, int *, char **);
+
+int unmap_output(int, char *, unsigned long, unsigned long, const char *);
+
+int send_output_fd(int, const char *);
+
+int open_direct_writer(const char *, int, int, struct direct_writer *);
+
+int direct_writer_put(struct direct_writer *, const char *, unsigned long);
+
+char *direct_writer_reserve(struct direct_writer *, unsigned long);
+
+int direct_writer_commit(struct direct_writer *, unsigned long);
+
+int direct_writer_flush(struct direct_writer *, int);
+
+int close_direct_writer(struct direct_writer *);
+
+void *direct_writer_run(void *);
+
+void *direct_write_run(void *);
+
+int is_zero_block(const unsigned char *, unsigned long);
+
+void start_write_behind(FILE *, struct band_queue *);
+
+void push_band(struct band_queue *, const char *, unsigned long, unsigned long, unsigned int);
+
+void push_band_in_order(const struct convert_job *, unsigned int);
+
+int finish_write_behind(struct band_queue *);
+
+void *write_behind_run(void *);
+
+int write_band(FILE *, const struct row_band *);
+
+int open_ring(const char *, unsigned int, unsigned int, int, int, unsigned long, struct row_ring *);
+
+unsigned char *ring_slot(struct row_ring *, unsigned int);
+
+void ring_publish(struct row_ring *, unsigned int);
+
+int ring_put_rows(struct row_ring *, const char *, unsigned long, unsigned int);
+
+int close_ring(struct row_ring *, int);
+
+// - TAR -
+int tar_entry_name(const char *, const char *, char[TAR_NAME_SIZE]);
+
+size_t tar_name_split(const char *);
+
+int write_tar_header(FILE *, const char *, unsigned long long);
+
+int write_tar_padding(FILE *, unsigned long long);
+
+int open_tar_reader(const char *, struct tar_reader *);
+
+int next_tar_member(struct tar_reader *, const char **, unsigned long long *);
+
+void close_tar_reader(struct tar_reader *);
+
+int has_png_extension(const char *);
+
+int make_parent_directories(char *, size_t);
+
+// - TENSOR -
+int format_npy_header(char[MAX_HEADER], unsigned int, unsigned int, int, const struct tensor_format *);
+
+void store_tensor_row(const unsigned char *, unsigned char *, unsigned int, unsigned int, unsigned int, int, const struct tensor_format *, unsigned char *);
+
+void bytes_to_floats(const unsigned char *, float *, unsigned long, int, const float *, const float *);
+
+// - AUTO GRAY -
+int is_gray_palette(const struct palette *);
+
+int is_gray_row(const unsigned char *, unsigned int);
+
+int is_gray_rows(unsigned int, unsigned int, unsigned long, const unsigned char *);
+
+void pack_gray(unsigned int, unsigned int, unsigned long, const unsigned char *, unsigned char *);
+
+// - CONVERSION -
+row_kernel prepare_conversion(char, struct chunk, int, struct chunk, const unsigned char[3], int, struct conversion *);
+
+void copy_gray(const unsigned char *, unsigned char *, unsigned int, const struct conversion *);
+
+void copy_rgb(const unsigned char *, unsigned char *, unsigned int, const struct conversion *);
+
+void copy_gray_alpha(const unsigned char *, unsigned char *, unsigned int, const struct conversion *);
+
+void copy_rgba(const unsigned char *, unsigned char *, unsigned int, const struct conversion *);
+
+// - COMPOSITE -
+row_kernel select_composite_kernel(char);
+
+void composite_gray_alpha(const unsigned char *, unsigned char *, unsigned int, const struct conversion *);
+
+void composite_rgba(const unsigned char *, unsigned char *, unsigned int, const struct conversion *);
+
+row_kernel select_strip_alpha_kernel(char);
+
+void strip_gray_alpha(const unsigned char *, unsigned char *, unsigned int, const struct conversion *);
+
+void strip_rgba(const unsigned char *, unsigned char *, unsigned int, const struct conversion *);
+
+int is_opaque_image(unsigned int, unsigned int, int, const char *);
+
+#if defined(HAVE_SSE2)
+void composite_gray_alpha_sse2(const unsigned char *, unsigned char *, unsigned int, const struct conversion *);
+
+void composite_rgba_sse2(const unsigned char *, unsigned char *, unsigned int, const struct conversion *);
+
+void strip_gray_alpha_sse2(const unsigned char *, unsigned char *, unsigned int, const struct conversion *);
+#endif
+
+#if defined(HAVE_X86_DISPATCH)
+int cpu_supports(enum cpu_feature);
+
+void composite_gray_alpha_avx2(const unsigned char *, unsigned char *, unsigned int, const struct conversion *);
+
+void composite_rgba_avx2(const unsigned char *, unsigned char *, unsigned int, const struct conversion *);
+
+void strip_rgba_ssse3(const unsigned char *, unsigned char *, unsigned int, const struct conversion *);
+#endif
+
+#if defined(HAVE_NEON)
+int all_zero_neon(uint8x16_t);
+
+void composite_gray_alpha_neon(const unsigned char *, unsigned char *, unsigned int, const struct conversion *);
+
+void composite_rgba_neon(const unsigned char *, unsigned char *, unsigned int, const struct conversion *);
+#endif
+
+// - PALETTE -
+row_kernel select_palette_kernel(const struct palette *);
+
+void expand_palette(const unsigned char *, unsigned char *, unsigned int, const struct conversion *);
+
+#if defined(HAVE_X86_DISPATCH)
+void expand_palette_ssse3(const unsigned char *, unsigned char *, unsigned int, const struct conversion *);
+
+void expand_palette_avx2(const unsigned char *, unsigned char *, unsigned int, const struct conversion *);
+
+void expand_palette_vbmi(const unsigned char *, unsigned char *, unsigned int, const struct conversion *);
+#endif
+
+row_kernel select_palette_rgba_kernel(void);
+
+void expand_palette_rgba(const unsigned char *, unsigned char *, unsigned int, const struct conversion *);
+
+#if defined(HAVE_X86_DISPATCH)
+void expand_palette_rgba_avx2(const unsigned char *, unsigned char *, unsigned int, const struct conversion *);
+#endif
+
+// - GRAY -
+void make_gray_table(struct chunk, unsigned char, struct gray_table *);
+
+void list_changed_gray(struct gray_table *);
+
+row_kernel select_gray_kernel(const struct gray_table *);
+
+void map_gray(const unsigned char *, unsigned char *, unsigned int, const struct conversion *);
+
+#if defined(HAVE_SSE2)
+void map_gray_sse2(const unsigned char *, unsigned char *, unsigned int, const struct conversion *);
+#endif
+
+#if defined(HAVE_X86_DISPATCH)
+__m512i lookup_vbmi(const __m512i[4], __m512i);
+
+void map_gray_vbmi(const unsigned char *, unsigned char *, unsigned int, const struct conversion *);
+#endif
+
+void expand_gray_key(const unsigned char *, unsigned char *, unsigned int, const struct conversion *);
+
+// - COLOR KEY -
+void make_color_keys(struct chunk, struct color_keys *);
+
+row_kernel select_color_key_kernel(const struct color_keys *);
+
+void replace_color_keys(const unsigned char *, unsigned char *, unsigned int, const struct conversion *);
+
+#if defined(HAVE_SSE2)
+void replace_color_key_sse2(const unsigned char *, unsigned char *, unsigned int, const struct conversion *);
+#endif
+
+void expand_color_keys(const unsigned char *, unsigned char *, unsigned int, const struct conversion *);
+
 // - UTILS -
 int check_equal_array(int, const char[], const char[]);
 
@@ -93,6 +681,35 @@ int make_int_char4(char, char, char, char);
 
 int union_two(unsigned long, const char *, unsigned long, const char *, char **);
 
+unsigned long packed_row_bytes(unsigned int, int);
+
+unsigned long image_data_size(unsigned int, unsigned int, int);
+
+int output_fits(unsigned int, unsigned int, int, int);
+
+unsigned long adam7_data_size(unsigned int, unsigned int, int, int);
+
+unsigned int adam7_pass_width(unsigned int, int);
+
+unsigned int adam7_pass_height(unsigned int, int);
+
+// - THREADS -
+int start_task(struct thread_task *);
+
+void join_task(struct thread_task *);
+
+void init_signal(struct task_signal *);
+
+void destroy_signal(struct task_signal *);
+
+void lock_signal(struct task_signal *);
+
+void unlock_signal(struct task_signal *);
+
+void wait_signal(struct task_signal *);
+
+void notify_signal(struct task_signal *);
+
 // - CRC -
 void make_crc_table(unsigned long *);
 
@@ -102,59 +719,261 @@ int crc(unsigned int *, const unsigned long *, const unsigned char *, const unsi
 
 int main(int argc, char *argv[])
 {
-	if (argc != 3 && argc != 4 && argc != 6)
+	struct options options;
+	char **positional = malloc((argc + 1) * sizeof(char *));
+	if (positional == NULL)
+	{
+		ERROR_MESSAGE_OUT_OF_MEMORY("arguments", ERROR_OUT_OF_MEMORY)
+	}
+	int error_options = parse_options(argc, argv, &options, &argc, positional);
+	if (error_options != SUCCESS)
+	{
+		free(positional);
+		return error_options;
+	}
+	argv = positional;
+
+	if (options.tar_path == NULL && options.tar_input == NULL && argc != 3 && argc != 4 && argc != 6)
 	{
 		fprintf(stderr,
 				"Number of arguments is %d, but must be not less than 2 "
-				"(... input_file output_file R/X G B), where R/X G B is optional.\n",
+				"(... [--preview-pass N] [--16bit] [--pam] [--auto-gray] [--mmap | --memfd TARGET | --direct-io | --sparse | --write-behind | --ring] [-j N] input_file output_file R/X G B), where R/X G B is optional, "
+				"or (... --tar archive input_file...), or (... --from-tar archive output_directory | --from-tar archive --tar archive); "
+				"--npy hwc|chw [--float32 [--mean M] [--std S]] writes a NumPy tensor instead.\n",
 				argc - 1);
+		free(positional);
 		return ERROR_PARAMETER_INVALID;
 	}
-
-	unsigned long crc_table[256];
-	make_crc_table(crc_table);
-
-	FILE *input;
-	if ((input = fopen(argv[1], "rb")) == NULL)
+	if (options.tar_path == NULL && options.tar_input == NULL)
 	{
-		ERROR_MESSAGE_CANNOT_OPEN_FILE(argv[1], "rb", ERROR_CANNOT_OPEN_FILE)
+		int return_code = convert_image(options, argc, argv, NULL, NULL);
+		free(positional);
+		return return_code;
 	}
 
-	char signature[8];
-	if (read_nbytes_file(signature, 8, input) != SUCCESS)
+	// --tar ARCHIVE input_file...: every image becomes an entry named after the relative path of its
+	// input file, written as soon as it is converted. Images that fail are reported and left out.
+	// --from-tar ARCHIVE takes the images from the .png members of a tar archive instead and writes
+	// them under an output directory (keeping the member paths) or, with --tar, to the output archive.
+	if (options.tar_input != NULL ? argc != (options.tar_path != NULL ? 1 : 2) : argc < 2)
 	{
-		fprintf(stderr, "Error while read file's signature from input file.\n");
-		fclose(input);
-		return ERROR_DATA_INVALID;
+		if (options.tar_input != NULL)
+		{
+			fprintf(stderr, "Option --from-tar expects an output directory or --tar (... --from-tar archive output_directory).\n");
+		}
+		else
+		{
+			fprintf(stderr, "Option --tar expects at least one input file (... --tar archive input_file...).\n");
+		}
+		free(positional);
+		return ERROR_PARAMETER_INVALID;
 	}
-	if (!check_equal_array(8, signature, PNG_SIGNATURE))
+	if (options.tar_path == NULL)
 	{
-		fprintf(stderr, "Input file is not png\n");
-		fclose(input);
-		return ERROR_DATA_INVALID;
+		int return_code = convert_tar_members(options, argv[1], NULL);
+		free(positional);
+		return return_code;
 	}
-
-	struct chunk ihdr;
-	CHECK_ERROR_WITH_FREE(SUCCESS, read_chunk(input, &ihdr, crc_table), read_ihdr_chunk, fclose(input))
-	int error_block_1 = SUCCESS;
-
-	if (ihdr.type != IHDR)
+	FILE *archive = stdout;
+	if (strcmp(options.tar_path, "-") == 0)
 	{
-		fprintf(stderr, "First chunk is not IHDR.\n");
-		ERROR_GOTO(error_block_1, ERROR_DATA_INVALID, block_1)
+#if defined(_WIN32)
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
 	}
-	unsigned int width = make_int_char4(ihdr.data[0], ihdr.data[1], ihdr.data[2], ihdr.data[3]);
-	unsigned int height = make_int_char4(ihdr.data[4], ihdr.data[5], ihdr.data[6], ihdr.data[7]);
-	char color_type = ihdr.data[9];
-	int bytes_pixel = 1;
-	int bytes_pixel_out = 1;
-	if (color_type == 2)
+	else if ((archive = fopen(options.tar_path, "wb")) == NULL)
 	{
-		bytes_pixel_out = bytes_pixel = 3;
+		free(positional);
+		ERROR_MESSAGE_CANNOT_OPEN_FILE(options.tar_path, "wb", ERROR_CANNOT_OPEN_FILE)
 	}
-	else if (color_type == 3)
+	int main_return_code = SUCCESS;
+	if (options.tar_input != NULL)
 	{
-		bytes_pixel_out = 3;
+		main_return_code = convert_tar_members(options, NULL, archive);
+	}
+	for (int i = 1; i < argc; i++)
+	{
+		char entry[TAR_NAME_SIZE];
+		int error_image = tar_entry_name(argv[i], output_extension(&options), entry);
+		if (error_image == SUCCESS)
+		{
+			char *image_argv[3] = { argv[0], argv[i], entry };
+			error_image = convert_image(options, 3, image_argv, archive, NULL);
+		}
+		if (error_image != SUCCESS)
+		{
+			fprintf(stderr, "Skipped \"%s\".\n", argv[i]);
+			main_return_code = main_return_code == SUCCESS ? error_image : main_return_code;
+		}
+		if (ferror(archive))
+		{
+			break;
+		}
+	}
+	// the archive ends with two zero blocks
+	char end[2 * TAR_BLOCK] = { 0 };
+	if (fwrite(end, sizeof(char), sizeof(end), archive) != sizeof(end) || (archive == stdout ? fflush(archive) : fclose(archive)) != 0)
+	{
+		fprintf(stderr, "Error write in output file \"%s\".\n", options.tar_path);
+		main_return_code = ERROR_UNKNOWN;
+	}
+	free(positional);
+	return main_return_code;
+}
+
+// Either one value for every channel or up to 4 comma separated values, one per channel; channels
+// past the given values keep what `values` held.
+int parse_channel_values(const char *text, float values[4])
+{
+	float parsed[4];
+	int count = 0;
+	const char *c = text;
+	for (;;)
+	{
+		char *end = NULL;
+		if (count == 4)
+		{
+			return ERROR_PARAMETER_INVALID;
+		}
+		parsed[count++] = strtof(c, &end);
+		if (end == c || (*end != ',' && *end != '\0'))
+		{
+			return ERROR_PARAMETER_INVALID;
+		}
+		if (*end == '\0')
+		{
+			break;
+		}
+		c = end + 1;
+	}
+	for (int i = 0; i < 4; i++)
+	{
+		values[i] = count == 1 ? parsed[0] : i < count ? parsed[i] : values[i];
+	}
+	return SUCCESS;
+}
+
+const char *output_extension(const struct options *options)
+{
+	return options->npy ? ".npy" : options->keep_alpha ? ".pam" : ".pnm";
+}
+
+// Converts the .png members of options.tar_input one by one, each read from the archive bytes
+// through a memory stream. Results go to `directory` or, without one, to `archive`.
+int convert_tar_members(struct options options, const char *directory, FILE *archive)
+{
+#if defined(_WIN32)
+	(void)directory;
+	(void)archive;
+	fprintf(stderr, "Option --from-tar is not supported on this platform.\n");
+	return ERROR_UNSUPPORTED;
+#else
+	struct tar_reader reader;
+	int return_code = open_tar_reader(options.tar_input, &reader);
+	if (return_code != SUCCESS)
+	{
+		return return_code;
+	}
+	const char *data;
+	unsigned long long size;
+	int error_member;
+	while ((error_member = next_tar_member(&reader, &data, &size)) == SUCCESS && data != NULL)
+	{
+		if (!has_png_extension(reader.name) || size == 0)
+		{
+			continue;
+		}
+		char entry[TAR_NAME_SIZE];
+		int error_image = tar_entry_name(reader.name, output_extension(&options), entry);
+		char *path = NULL;
+		if (error_image == SUCCESS && directory != NULL)
+		{
+			path = malloc(strlen(directory) + strlen(entry) + 2);
+			if (path == NULL)
+			{
+				error_image = ERROR_OUT_OF_MEMORY;
+			}
+			else
+			{
+				sprintf(path, "%s/%s", directory, entry);
+				error_image = make_parent_directories(path, strlen(directory) + 1);
+			}
+		}
+		FILE *source = NULL;
+		if (error_image == SUCCESS && (source = fmemopen((void *)data, size, "rb")) == NULL)
+		{
+			error_image = ERROR_OUT_OF_MEMORY;
+		}
+		if (error_image == SUCCESS)
+		{
+			char *image_argv[3] = { "", reader.name, path != NULL ? path : entry };
+			error_image = convert_image(options, 3, image_argv, archive, source);
+		}
+		free(path);
+		if (error_image != SUCCESS)
+		{
+			fprintf(stderr, "Skipped \"%s\".\n", reader.name);
+			return_code = return_code == SUCCESS ? error_image : return_code;
+		}
+		if (archive != NULL && ferror(archive))
+		{
+			break;
+		}
+	}
+	close_tar_reader(&reader);
+	return return_code == SUCCESS ? error_member : return_code;
+#endif
+}
+
+// Converts argv[1] to argv[2] (R/X G B from argv[3..5]); with an `archive` the result is appended
+// to it as a tar entry named argv[2] instead. A `source` stream is read in place of the file
+// argv[1] and is closed like it.
+int convert_image(struct options options, int argc, char *argv[], FILE *archive, FILE *source)
+{
+	unsigned long crc_table[256];
+	make_crc_table(crc_table);
+
+	FILE *input = source;
+	if (input == NULL && (input = fopen(argv[1], "rb")) == NULL)
+	{
+		ERROR_MESSAGE_CANNOT_OPEN_FILE(argv[1], "rb", ERROR_CANNOT_OPEN_FILE)
+	}
+
+	char signature[8];
+	if (read_nbytes_file(signature, 8, input) != SUCCESS)
+	{
+		fprintf(stderr, "Error while read file's signature from input file.\n");
+		fclose(input);
+		return ERROR_DATA_INVALID;
+	}
+	if (!check_equal_array(8, signature, PNG_SIGNATURE))
+	{
+		fprintf(stderr, "Input file is not png\n");
+		fclose(input);
+		return ERROR_DATA_INVALID;
+	}
+
+	struct chunk ihdr;
+	CHECK_ERROR_WITH_FREE(SUCCESS, read_chunk(input, &ihdr, crc_table), read_ihdr_chunk, fclose(input))
+	int error_block_1 = SUCCESS;
+
+	if (ihdr.type != IHDR)
+	{
+		fprintf(stderr, "First chunk is not IHDR.\n");
+		ERROR_GOTO(error_block_1, ERROR_DATA_INVALID, block_1)
+	}
+	unsigned int width = make_int_char4(ihdr.data[0], ihdr.data[1], ihdr.data[2], ihdr.data[3]);
+	unsigned int height = make_int_char4(ihdr.data[4], ihdr.data[5], ihdr.data[6], ihdr.data[7]);
+	char color_type = ihdr.data[9];
+	int bytes_pixel = 1;
+	int bytes_pixel_out = 1;
+	if (color_type == 2)
+	{
+		bytes_pixel_out = bytes_pixel = 3;
+	}
+	else if (color_type == 3)
+	{
+		bytes_pixel_out = 3;
 	}
 	else if (color_type == 4)
 	{
@@ -167,11 +986,31 @@ int main(int argc, char *argv[])
 		bytes_pixel = 4;
 	}
 
-	if (ihdr.data[8] != 8 || ihdr.data[10] != 0 || ihdr.data[11] != 0 || ihdr.data[12] != 0)
+	char interlace = ihdr.data[12];
+	int bit_depth = (unsigned char)ihdr.data[8];
+	int bits_pixel = bit_depth * bytes_pixel;
+	int sub_byte = (color_type == 0 || color_type == 3) && (bit_depth == 1 || bit_depth == 2 || bit_depth == 4);
+	int keep_16bit = bit_depth == 16 && options.keep_16bit;
+	if (bit_depth == 16)
+	{
+		bytes_pixel *= 2;
+	}
+	if (keep_16bit)
+	{
+		bytes_pixel_out *= 2;
+	}
+
+	if ((bit_depth != 8 && bit_depth != 16 && !sub_byte) || (bit_depth == 16 && color_type == 3) || ihdr.data[10] != 0 || ihdr.data[11] != 0 || (interlace != 0 && interlace != 1))
 	{
 		fprintf(stderr, "Unsupported png image.\n");
 		ERROR_GOTO(error_block_1, ERROR_UNSUPPORTED, block_1)
 	}
+	// checked again once PAM alpha has settled bytes_pixel_out; this rejects before decompressing
+	int element_size = options.npy && options.tensor.float32 ? (int)sizeof(float) : 1;
+	if (!output_fits(width, height, bytes_pixel_out, element_size))
+	{
+		ERROR_GOTO(error_block_1, ERROR_UNSUPPORTED, block_1)
+	}
 
 block_1:;
 	free_chunk(ihdr);
@@ -234,8 +1073,23 @@ block_1:;
 		}
 	}
 
+	int passes = options.preview_pass ? options.preview_pass : ADAM7_PASSES;
+	// libdeflate can only decompress the whole stream, the other libraries stop once the output is full
+#if defined(LIBDEFLATE)
+	int inflate_passes = ADAM7_PASSES;
+#else
+	int inflate_passes = passes;
+#endif
+	unsigned long png_data_len =
+		interlace ? adam7_data_size(width, height, bits_pixel, inflate_passes) : image_data_size(width, height, bits_pixel);
+	// sub-byte rows are unpacked to one byte per pixel in place, so leave room for them
+	unsigned long png_data_alloc = png_data_len;
+	if (!interlace && image_data_size(width, height, bytes_pixel * 8) > png_data_alloc)
+	{
+		png_data_alloc = image_data_size(width, height, bytes_pixel * 8);
+	}
 	char *png_data;
-	int alloc_vec_png_data = allocate_vector(bytes_pixel * (width * height + height), &png_data);
+	int alloc_vec_png_data = allocate_vector(png_data_alloc, &png_data);
 	if (alloc_vec_png_data != SUCCESS)
 	{
 		fprintf(stderr, "Error allocate for png_data vector.\n");
@@ -269,7 +1123,7 @@ block_2:
 	infl.zfree = Z_NULL;
 	infl.avail_in = i_data_len;
 	infl.next_in = (Bytef *)i_data;
-	infl.avail_out = bytes_pixel * (width * height + height);
+	infl.avail_out = png_data_len;
 	infl.next_out = (Bytef *)png_data;
 	if (inflateInit(&infl) != Z_OK)
 	{
@@ -277,7 +1131,9 @@ block_2:
 		ERROR_GOTO(error_block_3, ERROR_OUT_OF_MEMORY, block_3)
 	}
 
-	if (inflate(&infl, Z_NO_FLUSH) != Z_STREAM_END)
+	int error_inflate = inflate(&infl, Z_NO_FLUSH);
+	int preview_done = interlace && inflate_passes < ADAM7_PASSES && infl.avail_out == 0;
+	if (error_inflate != Z_STREAM_END && !(preview_done && (error_inflate == Z_OK || error_inflate == Z_BUF_ERROR)))
 	{
 		fprintf(stderr, "Chunks IDAT is broken with ZLIB.\n");
 		ERROR_GOTO(error_block_3, ERROR_DATA_INVALID, block_3)
@@ -287,7 +1143,7 @@ block_2:
 	infl = libdeflate_alloc_decompressor();
 	unsigned long end;
 	enum libdeflate_result error_inflate =
-		libdeflate_zlib_decompress(infl, i_data, i_data_len, png_data, bytes_pixel * (width * height + height), &end);
+		libdeflate_zlib_decompress(infl, i_data, i_data_len, png_data, png_data_len, &end);
 	if (error_inflate != LIBDEFLATE_SUCCESS)
 	{
 		fprintf(stderr, "Error while decompress IDAT chunks with LIBDEFLATE.\n");
@@ -309,7 +1165,7 @@ block_2:
 
 	istate->next_in = (uint8_t *)i_data;
 	istate->avail_in = i_data_len;
-	istate->avail_out = bytes_pixel * (width * height + height);
+	istate->avail_out = png_data_len;
 	istate->next_out = (uint8_t *)png_data;
 
 	int error_read_header = isal_read_zlib_header(istate, iheader);
@@ -350,11 +1206,87 @@ block_3:;
 #endif
 	free(i_data);
 
-	char *lines;
-	int allocate_result_vector = allocate_vector(width * height * bytes_pixel_out * sizeof(char), &lines);
-	if (allocate_result_vector != SUCCESS)
+	unsigned char unpack_table[256][8];
+	if (sub_byte)
+	{
+		make_unpack_table(bit_depth, color_type == 0, unpack_table);
+	}
+
+	if (interlace && error_block_3 == SUCCESS)
+	{
+		error_block_3 = deinterlace_png(width, height, bits_pixel, passes, sub_byte ? unpack_table : NULL, &png_data);
+	}
+	else if (error_block_3 == SUCCESS)
+	{
+		unfilter_packed_png(width, height, bits_pixel, png_data);
+		if (sub_byte)
+		{
+			unpack_png(width, height, bit_depth, unpack_table, png_data, png_data);
+		}
+		if (options.preview_pass)
+		{
+			subsample_png(width, height, bytes_pixel, passes, png_data);
+		}
+	}
+	if (options.preview_pass)
+	{
+		width = (width + PREVIEW_SX[passes - 1] - 1) / PREVIEW_SX[passes - 1];
+		height = (height + PREVIEW_SY[passes - 1] - 1) / PREVIEW_SY[passes - 1];
+	}
+	if (bit_depth == 16 && !keep_16bit && error_block_3 == SUCCESS)
+	{
+		// a 16-bit color key becomes an alpha channel, so it is matched on the full samples
+		int key_to_alpha = go_in_blocks[1] && (color_type == 0 || color_type == 2);
+		downconvert_png(width, height, bytes_pixel / 2, key_to_alpha ? in_blocks[1] : NULL, png_data);
+		bytes_pixel = bytes_pixel / 2 + key_to_alpha;
+		if (key_to_alpha)
+		{
+			color_type = (char)(color_type == 0 ? 4 : 6);
+			free_chunk(*in_blocks[1]);
+			go_in_blocks[1] = 0;
+		}
+	}
+
+	// Rows are converted inside png_data unless conversion runs on several threads (a band would
+	// overwrite rows of the previous one that are still to be read); palette rows and PAM tRNS
+	// alpha expand, so the buffer grows first. Expanding rows are converted back to front, so with
+	// --write-behind they go to a separate buffer instead, where bands can be written as they finish.
+	if (options.keep_alpha)
+	{
+		bytes_pixel_out = pam_depth(color_type, go_in_blocks[1]) * (keep_16bit ? 2 : 1);
+	}
+	if (error_block_3 == SUCCESS && !output_fits(width, height, bytes_pixel_out, element_size))
+	{
+		error_block_3 = ERROR_UNSUPPORTED;
+	}
+	// --npy rows always go through conversion, which stores them in the tensor layout
+	int direct_output = is_direct_output(color_type, go_in_blocks[1], options.keep_alpha) && !options.npy;
+	// --direct-io/--sparse on one thread convert 8-bit rows straight into the writer's buffers
+	int stream_direct = (options.direct_io || options.sparse) && options.threads == 1 && !direct_output && !keep_16bit && !options.auto_gray;
+	int in_place = !direct_output && !stream_direct && !options.mmap_output && !options.ring && !options.npy && options.threads == 1 && (!(keep_16bit || options.write_behind) || bytes_pixel_out <= bytes_pixel);
+	char *lines = NULL;
+	if (in_place && error_block_3 == SUCCESS)
+	{
+		unsigned long in_size = image_data_size(width, height, bytes_pixel * 8);
+		unsigned long out_size = (unsigned long)width * height * bytes_pixel_out;
+		if (out_size > in_size)
+		{
+			char *grown = realloc(png_data, out_size);
+			if (grown == NULL)
+			{
+				error_block_3 = ERROR_OUT_OF_MEMORY;
+			}
+			png_data = grown != NULL ? grown : png_data;
+		}
+		lines = png_data;
+	}
+	else if (!direct_output && !stream_direct && !options.mmap_output && !(options.ring && !keep_16bit) && error_block_3 == SUCCESS)
 	{
-		error_block_3 = allocate_result_vector;
+		int allocate_result_vector = allocate_vector((unsigned int)((unsigned long)width * height * bytes_pixel_out * element_size), &lines);
+		if (allocate_result_vector != SUCCESS)
+		{
+			error_block_3 = allocate_result_vector;
+		}
 	}
 
 	if (error_block_3 != SUCCESS)
@@ -374,397 +1306,3698 @@ block_3:;
 		return error_block_3;
 	}
 
-	unfilter_png(width, height, bytes_pixel, png_data);
-
 	unsigned char background[3] = { 0, 0, 0 };
+	unsigned short background16[3] = { 0, 0, 0 };
 	int go_background = 0;
-	change_background(argc, argv, color_type, plte, background, &go_background, go_in_blocks[0], (*in_blocks[0]));
-
-	int pos = 0;
-	write_to_lines(width, height, bytes_pixel, bytes_pixel_out, png_data, color_type, background, &pos, &lines, plte, go_in_blocks[1], (*in_blocks[1]));
-
-	free(png_data);
-	if (go_plte)
+	if (keep_16bit)
 	{
-		free_chunk(plte);
+		change_background(argc, argv, color_type, plte, background, &go_background, 0, (*in_blocks[0]));
+		change_background16(background, go_background, color_type, go_in_blocks[0], (*in_blocks[0]), background16);
 	}
-	for (int i = 0; i < num_in_blocks; i++)
+	else
 	{
-		if (go_in_blocks[i])
+		if ((sub_byte && color_type == 0) || bit_depth == 16)
 		{
-			free_chunk(*in_blocks[i]);
+			for (int i = 0; i < num_in_blocks; i++)
+			{
+				if (go_in_blocks[i])
+				{
+					scale_sample_chunk(bit_depth, *in_blocks[i]);
+				}
+			}
 		}
+		change_background(argc, argv, color_type, plte, background, &go_background, go_in_blocks[0], (*in_blocks[0]));
 	}
 
-	FILE *output;
-	if ((output = fopen(argv[2], "wb")) == NULL)
-	{
-		free(lines);
-		ERROR_MESSAGE_CANNOT_OPEN_FILE(argv[2], "wb", ERROR_CANNOT_OPEN_FILE)
-	}
-
-	fprintf(output, "P%c\n", ((color_type == 0 || color_type == 4) ? '5' : '6'));
-	fprintf(output, "%u %u\n", width, height);
-	fprintf(output, "255\n");
-
-	unsigned long error_puts = fwrite(lines, sizeof(char), width * height * bytes_pixel_out, output);
-	int main_return_code = SUCCESS;
-	if (error_puts != pos)
-	{
-		fprintf(stderr, "Error write in output file TOTAL OUT = %lu\\%d\n", error_puts, pos);
-		main_return_code = ERROR_UNKNOWN;
-	}
-
-	fclose(output);
-	free(lines);
-	return main_return_code;
-}
-
-// - MAJOR -
+	// --auto-gray writes images whose output has R == G == B everywhere as P5 (8-bit PNM only)
+	int gray_output = color_type == 0 || color_type == 4;
+	int auto_gray = options.auto_gray && !keep_16bit && !options.keep_alpha && !gray_output && !options.ring && !options.npy;
 
-void write_to_lines(
-	unsigned int width,
-	unsigned int height,
-	int bytes_pixel,
-	int bytes_pixel_out,
-	const char *png_data,
-	char color_type,
-	const unsigned char background[3],
-	int *pos,
-	char **lines,
-	struct chunk plte,
-	int go_trns,
-	struct chunk trns)
-{
-	for (int i = 0; i < height; i++)
+	// --mmap: the file is created with its final size (--auto-gray can only shrink it) and the
+	// rows are converted straight into the mapping behind the header.
+	char header[MAX_HEADER];
+	int header_len = format_header(header, width, height, bytes_pixel_out, keep_16bit, options.keep_alpha, gray_output);
+	unsigned long map_size = header_len + (unsigned long)width * height * bytes_pixel_out;
+	int output_fd = -1;
+	char *map = NULL;
+	if (options.mmap_output)
 	{
-		for (int j = 1; j < width * bytes_pixel + 1; j++)
+		int error_map = map_output(argv[2], map_size, options.memfd_target != NULL, &output_fd, &map);
+		if (error_map != SUCCESS)
 		{
-			if (color_type == 6 || color_type == 4)
+			free(png_data);
+			if (go_plte)
 			{
-				int ialp = (unsigned char)ARR(png_data, i, j + bytes_pixel_out, width * bytes_pixel + 1);
-				float alpha = (float)ialp / 255;
-				for (int it = 0; it < bytes_pixel_out; it++)
-				{
-					unsigned char pix = ARR(png_data, i, j + it, width * bytes_pixel + 1);
-					(*lines)[(*pos)++] = (char)(alpha * (float)pix + (1 - alpha) * (float)background[it]);
-				}
-				j += bytes_pixel_out;
+				free_chunk(plte);
 			}
-			if (color_type == 3)
+			for (int i = 0; i < num_in_blocks; i++)
 			{
-				unsigned char number_plte_block = ARR(png_data, i, j, width * bytes_pixel + 1);
-				char r = ARR(plte.data, number_plte_block, 0, 3);
-				char g = ARR(plte.data, number_plte_block, 1, 3);
-				char b = ARR(plte.data, number_plte_block, 2, 3);
-				if (go_trns)
+				if (go_in_blocks[i])
 				{
-					if (number_plte_block < trns.length)
-					{
-						int ialp = (unsigned char)trns.data[number_plte_block];
-						float alpha = (float)ialp / 255;
-						r = (char)(alpha * (float)r + (1 - alpha) * (float)background[0]);
-						g = (char)(alpha * (float)g + (1 - alpha) * (float)background[1]);
-						b = (char)(alpha * (float)b + (1 - alpha) * (float)background[2]);
-					}
+					free_chunk(*in_blocks[i]);
 				}
-				(*lines)[(*pos)++] = r;
-				(*lines)[(*pos)++] = g;
-				(*lines)[(*pos)++] = b;
 			}
-			if (color_type == 2)
+			return error_map;
+		}
+		lines = map;
+	}
+
+	// --ring: rows are published to a consumer through shared memory as soon as they are ready;
+	// 8-bit rows are converted straight into the ring slots.
+	struct row_ring ring;
+	if (options.ring)
+	{
+		int depth = bytes_pixel_out / (keep_16bit ? 2 : 1);
+		int error_ring = open_ring(argv[2], width, height, depth, keep_16bit ? 65535 : 255, width * bytes_pixel_out, &ring);
+		if (error_ring != SUCCESS)
+		{
+			free(png_data);
+			free(lines);
+			if (go_plte)
 			{
-				char r = ARR(png_data, i, j++, width * bytes_pixel + 1);
-				char g = ARR(png_data, i, j++, width * bytes_pixel + 1);
-				char b = ARR(png_data, i, j, width * bytes_pixel + 1);
-				if (go_trns)
-				{
-					for (int ti = 0; ti < trns.length / 6; ti++)
-					{
-						if (r == ARR(trns.data, ti, 1, 6) && g == ARR(trns.data, ti, 3, 6) && b == ARR(trns.data, ti, 5, 6))
-						{
-							r = (char)background[0];
-							g = (char)background[1];
-							b = (char)background[2];
-							break;
-						}
-					}
-				}
-				(*lines)[(*pos)++] = r;
-				(*lines)[(*pos)++] = g;
-				(*lines)[(*pos)++] = b;
+				free_chunk(plte);
 			}
-			if (color_type == 0)
+			for (int i = 0; i < num_in_blocks; i++)
 			{
-				char x = ARR(png_data, i, j, width * bytes_pixel + 1);
-				if (go_trns)
+				if (go_in_blocks[i])
 				{
-					for (int ti = 0; ti < trns.length / 2; ti++)
-					{
-						if (x == ARR(trns.data, ti, 1, 2))
-						{
-							x = (char)background[0];
-						}
-					}
+					free_chunk(*in_blocks[i]);
 				}
-				(*lines)[(*pos)++] = x;
 			}
+			return error_ring;
 		}
 	}
-}
 
-void change_background(int argc, char *argv[], char color_type, struct chunk plte, unsigned char background[], int *go_background, int go_bkgd, struct chunk bkgd)
-{
-	if (argc == 4)
+	// --write-behind: finished bands are written by a task while the next ones are converted. The
+	// header goes first, so with --auto-gray pending everything is queued after the conversion.
+	FILE *output = NULL;
+	struct band_queue queue;
+	struct band_queue *stream = NULL;
+	if (options.write_behind)
 	{
-		unsigned char x = strtol(argv[3], NULL, 10);
-		if (color_type == 3)
+		if ((output = fopen(argv[2], "wb")) == NULL)
 		{
-			if (x < plte.length / 3)
+			free(png_data);
+			if (!in_place)
 			{
-				background[0] = ARR(plte.data, x, 0, 3);
-				background[1] = ARR(plte.data, x, 1, 3);
-				background[2] = ARR(plte.data, x, 2, 3);
+				free(lines);
+			}
+			if (go_plte)
+			{
+				free_chunk(plte);
 			}
+			for (int i = 0; i < num_in_blocks; i++)
+			{
+				if (go_in_blocks[i])
+				{
+					free_chunk(*in_blocks[i]);
+				}
+			}
+			ERROR_MESSAGE_CANNOT_OPEN_FILE(argv[2], "wb", ERROR_CANNOT_OPEN_FILE)
+		}
+		start_write_behind(output, &queue);
+		if (!auto_gray)
+		{
+			push_band(&queue, header, header_len, header_len, 1);
+			stream = &queue;
 		}
 		else
 		{
-			background[0] = background[1] = background[2] = (char)x;
+			fprintf(stderr, "Option --write-behind with --auto-gray writes \"%s\" after the conversion.\n", argv[2]);
 		}
-		*go_background = 1;
 	}
-	else if (argc == 6)
+	int streamed = 0;
+
+	// --direct-io/--sparse: with stream_direct the header goes into the first buffer now and each
+	// filled buffer is written while the rows of the next one are converted; otherwise the rows
+	// are converted first and copied into the buffers below.
+	struct direct_writer writer;
+	if (stream_direct)
 	{
-		for (int i = 0; i < 3; i++)
+		int error_direct = open_direct_writer(argv[2], options.direct_io, options.sparse, &writer);
+		if (error_direct != SUCCESS)
 		{
-			background[i] = (char)strtol(argv[3 + i], NULL, 10);
+			free(png_data);
+			if (go_plte)
+			{
+				free_chunk(plte);
+			}
+			for (int i = 0; i < num_in_blocks; i++)
+			{
+				if (go_in_blocks[i])
+				{
+					free_chunk(*in_blocks[i]);
+				}
+			}
+			return error_direct;
 		}
-		*go_background = 1;
+		direct_writer_put(&writer, header, header_len);
 	}
 
-	if (!(*go_background) && go_bkgd)
+	int pos = options.mmap_output ? header_len : 0;
+	int error_convert = SUCCESS;
+	if (direct_output)
 	{
-		if (color_type == 6 || color_type == 2)
+		char *out = options.mmap_output ? map + header_len : png_data;
+		if (auto_gray && is_gray_rows(width, height, width * bytes_pixel + 1, (const unsigned char *)png_data + 1))
 		{
-			background[0] = bkgd.data[1];
-			background[1] = bkgd.data[3];
-			background[2] = bkgd.data[5];
+			pack_gray(width, height, width * bytes_pixel + 1, (const unsigned char *)png_data + 1, (unsigned char *)out);
+			direct_output = 0;
+			bytes_pixel_out = 1;
+			gray_output = 1;
 		}
-		if (color_type == 0 || color_type == 4)
+		else if (options.mmap_output)
 		{
-			background[0] = background[1] = background[2] = bkgd.data[1];
+			copy_rows_direct(width, height, bytes_pixel, png_data, out);
+			direct_output = 0;
 		}
-		if (color_type == 3)
+		else if (options.ring)
 		{
-			unsigned char index_plte = bkgd.data[0];
-			background[0] = ARR(plte.data, index_plte, 0, 3);
-			background[1] = ARR(plte.data, index_plte, 1, 3);
+			error_convert = ring_put_rows(&ring, png_data + 1, width * bytes_pixel + 1, height);
+		}
+		if (!direct_output && !options.mmap_output)
+		{
+			lines = png_data;
+			png_data = NULL;
+		}
+		pos += (int)(width * height * bytes_pixel_out);
+	}
+	else
+	{
+		if (keep_16bit)
+		{
+			write_to_lines16(width, height, bytes_pixel, bytes_pixel_out, png_data, color_type, background16, &pos, &lines, go_in_blocks[1], (*in_blocks[1]), options.keep_alpha, stream);
+			streamed = stream != NULL;
+			if (options.ring)
+			{
+				error_convert = ring_put_rows(&ring, lines, width * bytes_pixel_out, height);
+			}
+		}
+		else
+		{
+			error_convert = write_to_lines(width, height, bytes_pixel, bytes_pixel_out, png_data, color_type, background, &pos, &lines, plte, go_in_blocks[1], (*in_blocks[1]), options.keep_alpha, &auto_gray, options.threads, stream, options.ring ? &ring : NULL, options.npy ? &options.tensor : NULL, stream_direct ? &writer : NULL);
+			streamed = stream != NULL;
+			if (auto_gray)
+			{
+				bytes_pixel_out = 1;
+				gray_output = 1;
+			}
+		}
+		if (!in_place)
+		{
+			free(png_data);
+		}
+		png_data = NULL;
+	}
+
+	if (go_plte)
+	{
+		free_chunk(plte);
+	}
+	for (int i = 0; i < num_in_blocks; i++)
+	{
+		if (go_in_blocks[i])
+		{
+			free_chunk(*in_blocks[i]);
+		}
+	}
+
+	if (options.mmap_output)
+	{
+		free(png_data);
+		format_header(header, width, height, bytes_pixel_out, keep_16bit, options.keep_alpha, gray_output);
+		memcpy(map, header, header_len);
+		int error_unmap = unmap_output(output_fd, map, map_size, (unsigned long)pos, error_convert == SUCCESS ? options.memfd_target : NULL);
+		return error_convert != SUCCESS ? error_convert : error_unmap;
+	}
+
+	if (options.ring)
+	{
+		free(png_data);
+		free(lines);
+		int error_ring = close_ring(&ring, error_convert != SUCCESS);
+		return error_convert != SUCCESS ? error_convert : error_ring;
+	}
+
+	if (options.write_behind)
+	{
+		if (error_convert == SUCCESS && stream == NULL)
+		{
+			header_len = format_header(header, width, height, bytes_pixel_out, keep_16bit, options.keep_alpha, gray_output);
+			push_band(&queue, header, header_len, header_len, 1);
+		}
+		if (error_convert == SUCCESS && direct_output)
+		{
+			push_band(&queue, png_data + 1, width * bytes_pixel, width * bytes_pixel + 1, height);
+		}
+		else if (error_convert == SUCCESS && !streamed)
+		{
+			push_band(&queue, lines, pos, pos, 1);
+		}
+		int error_write = finish_write_behind(&queue);
+		if (fclose(output) != 0 && error_write == SUCCESS)
+		{
+			fprintf(stderr, "Error write in output file.\n");
+			error_write = ERROR_UNKNOWN;
+		}
+		free(png_data);
+		free(lines);
+		return error_convert != SUCCESS ? error_convert : error_write;
+	}
+
+	if (stream_direct)
+	{
+		int error_direct = close_direct_writer(&writer);
+		free(lines);
+		return error_convert != SUCCESS ? error_convert : error_direct;
+	}
+
+	if (error_convert != SUCCESS)
+	{
+		free(lines);
+		return error_convert;
+	}
+
+	if (options.npy)
+	{
+		header_len = format_npy_header(header, width, height, bytes_pixel_out, &options.tensor);
+	}
+	else
+	{
+		header_len = format_header(header, width, height, bytes_pixel_out, keep_16bit, options.keep_alpha, gray_output);
+	}
+	if (options.direct_io || options.sparse)
+	{
+		int error_direct = open_direct_writer(argv[2], options.direct_io, options.sparse, &writer);
+		if (error_direct == SUCCESS)
+		{
+			direct_writer_put(&writer, header, header_len);
+			if (direct_output)
+			{
+				unsigned long row_len = width * bytes_pixel;
+				for (unsigned int i = 0; i < height; i++)
+				{
+					direct_writer_put(&writer, &ARR(png_data, i, 1, row_len + 1), row_len);
+				}
+			}
+			else
+			{
+				direct_writer_put(&writer, lines, pos);
+			}
+			error_direct = close_direct_writer(&writer);
+		}
+		free(png_data);
+		free(lines);
+		return error_direct;
+	}
+
+	unsigned long long output_size = header_len + (unsigned long long)pos;
+	if (archive != NULL)
+	{
+		output = archive;
+		if (write_tar_header(archive, argv[2], output_size) != SUCCESS)
+		{
+			free(png_data);
+			free(lines);
+			return ERROR_UNKNOWN;
+		}
+	}
+	else if ((output = fopen(argv[2], "wb")) == NULL)
+	{
+		free(png_data);
+		free(lines);
+		ERROR_MESSAGE_CANNOT_OPEN_FILE(argv[2], "wb", ERROR_CANNOT_OPEN_FILE)
+	}
+
+	fwrite(header, sizeof(char), header_len, output);
+
+	unsigned long error_puts;
+	if (direct_output)
+	{
+		error_puts = write_rows_direct(output, width, height, bytes_pixel, png_data);
+	}
+	else
+	{
+		error_puts = fwrite(lines, sizeof(char), pos, output);
+	}
+	int main_return_code = SUCCESS;
+	if (error_puts != pos)
+	{
+		fprintf(stderr, "Error write in output file TOTAL OUT = %lu\\%d\n", error_puts, pos);
+		main_return_code = ERROR_UNKNOWN;
+	}
+
+	if (archive != NULL)
+	{
+		if (write_tar_padding(archive, output_size) != SUCCESS)
+		{
+			main_return_code = ERROR_UNKNOWN;
+		}
+	}
+	else
+	{
+		fclose(output);
+	}
+	free(png_data);
+	free(lines);
+	return main_return_code;
+}
+
+// - MAJOR -
+
+// `positional` must have room for argc entries.
+int parse_options(int argc, char *argv[], struct options *options, int *positional_count, char *positional[])
+{
+	options->preview_pass = 0;
+	options->keep_16bit = 0;
+	options->threads = 1;
+	options->keep_alpha = 0;
+	options->auto_gray = 0;
+	options->mmap_output = 0;
+	options->memfd_target = NULL;
+	options->direct_io = 0;
+	options->sparse = 0;
+	options->write_behind = 0;
+	options->ring = 0;
+	options->tar_path = NULL;
+	options->tar_input = NULL;
+	options->npy = 0;
+	options->tensor.chw = 0;
+	options->tensor.float32 = 0;
+	float mean[4] = { 0, 0, 0, 0 };
+	float std[4] = { 1, 1, 1, 1 };
+	int normalize = 0;
+	*positional_count = 0;
+
+	for (int i = 0; i < argc; i++)
+	{
+		if (i > 0 && strcmp(argv[i], "--preview-pass") == 0)
+		{
+			char *end = NULL;
+			long pass = i + 1 < argc ? strtol(argv[i + 1], &end, 10) : 0;
+			if (end == NULL || *end != '\0' || pass < 1 || pass > ADAM7_PASSES)
+			{
+				fprintf(stderr, "Option --preview-pass expects a pass number from 1 to %d.\n", ADAM7_PASSES);
+				return ERROR_PARAMETER_INVALID;
+			}
+			options->preview_pass = (int)pass;
+			i++;
+		}
+		else if (i > 0 && strcmp(argv[i], "--16bit") == 0)
+		{
+			options->keep_16bit = 1;
+		}
+		else if (i > 0 && strcmp(argv[i], "--pam") == 0)
+		{
+			options->keep_alpha = 1;
+		}
+		else if (i > 0 && strcmp(argv[i], "--auto-gray") == 0)
+		{
+			options->auto_gray = 1;
+		}
+		else if (i > 0 && strcmp(argv[i], "--mmap") == 0)
+		{
+			options->mmap_output = 1;
+		}
+		else if (i > 0 && strcmp(argv[i], "--memfd") == 0)
+		{
+			if (i + 1 == argc)
+			{
+				fprintf(stderr, "Option --memfd expects a socket path or fd:N.\n");
+				return ERROR_PARAMETER_INVALID;
+			}
+			options->memfd_target = argv[++i];
+		}
+		else if (i > 0 && strcmp(argv[i], "--direct-io") == 0)
+		{
+			options->direct_io = 1;
+		}
+		else if (i > 0 && strcmp(argv[i], "--sparse") == 0)
+		{
+			options->sparse = 1;
+		}
+		else if (i > 0 && strcmp(argv[i], "--write-behind") == 0)
+		{
+			options->write_behind = 1;
+		}
+		else if (i > 0 && strcmp(argv[i], "--tar") == 0)
+		{
+			if (i + 1 == argc)
+			{
+				fprintf(stderr, "Option --tar expects an archive path or - for stdout.\n");
+				return ERROR_PARAMETER_INVALID;
+			}
+			options->tar_path = argv[++i];
+		}
+		else if (i > 0 && strcmp(argv[i], "--from-tar") == 0)
+		{
+			if (i + 1 == argc)
+			{
+				fprintf(stderr, "Option --from-tar expects an archive path or - for stdin.\n");
+				return ERROR_PARAMETER_INVALID;
+			}
+			options->tar_input = argv[++i];
+		}
+		else if (i > 0 && strcmp(argv[i], "--npy") == 0)
+		{
+			if (i + 1 == argc || (strcmp(argv[i + 1], "hwc") != 0 && strcmp(argv[i + 1], "chw") != 0))
+			{
+				fprintf(stderr, "Option --npy expects a layout, hwc or chw.\n");
+				return ERROR_PARAMETER_INVALID;
+			}
+			options->npy = 1;
+			options->tensor.chw = strcmp(argv[++i], "chw") == 0;
+		}
+		else if (i > 0 && strcmp(argv[i], "--float32") == 0)
+		{
+			options->tensor.float32 = 1;
+		}
+		else if (i > 0 && (strcmp(argv[i], "--mean") == 0 || strcmp(argv[i], "--std") == 0))
+		{
+			int is_mean = strcmp(argv[i], "--mean") == 0;
+			if (i + 1 == argc || parse_channel_values(argv[i + 1], is_mean ? mean : std) != SUCCESS)
+			{
+				fprintf(stderr, "Option %s expects one value or one value per channel, separated by commas.\n", argv[i]);
+				return ERROR_PARAMETER_INVALID;
+			}
+			normalize = 1;
+			i++;
+		}
+		else if (i > 0 && strcmp(argv[i], "--ring") == 0)
+		{
+			options->ring = 1;
+		}
+		else if (i > 0 && strcmp(argv[i], "-j") == 0)
+		{
+			char *end = NULL;
+			long threads = i + 1 < argc ? strtol(argv[i + 1], &end, 10) : 0;
+			if (end == NULL || *end != '\0' || threads < 1 || threads > MAX_THREADS)
+			{
+				fprintf(stderr, "Option -j expects a thread count from 1 to %d.\n", MAX_THREADS);
+				return ERROR_PARAMETER_INVALID;
+			}
+			options->threads = (int)threads;
+			i++;
+		}
+		else if (i > 0 && strncmp(argv[i], "--", 2) == 0)
+		{
+			fprintf(stderr, "Unknown option \"%s\".\n", argv[i]);
+			return ERROR_PARAMETER_INVALID;
+		}
+		else
+		{
+			positional[(*positional_count)++] = argv[i];
+		}
+	}
+	if ((options->mmap_output || options->memfd_target != NULL) + (options->direct_io || options->sparse) + options->write_behind + options->ring > 1)
+	{
+		fprintf(stderr, "Options --mmap/--memfd, --direct-io/--sparse, --write-behind and --ring cannot be used together.\n");
+		return ERROR_PARAMETER_INVALID;
+	}
+	if (options->ring && options->threads > 1)
+	{
+		fprintf(stderr, "Option --ring publishes rows in order from one thread and cannot be combined with -j.\n");
+		return ERROR_PARAMETER_INVALID;
+	}
+	if ((options->tensor.float32 || normalize) && !options->npy)
+	{
+		fprintf(stderr, "Options --float32, --mean and --std need --npy.\n");
+		return ERROR_PARAMETER_INVALID;
+	}
+	if (normalize && !options->tensor.float32)
+	{
+		fprintf(stderr, "Options --mean and --std need --float32.\n");
+		return ERROR_PARAMETER_INVALID;
+	}
+	if (options->npy && (options->keep_16bit || options->mmap_output || options->direct_io || options->sparse || options->write_behind || options->ring))
+	{
+		fprintf(stderr, "Option --npy cannot be combined with --16bit or with output modes other than --tar.\n");
+		return ERROR_PARAMETER_INVALID;
+	}
+	for (int c = 0; c < 4; c++)
+	{
+		if (std[c] == 0)
+		{
+			fprintf(stderr, "Option --std expects nonzero values.\n");
+			return ERROR_PARAMETER_INVALID;
+		}
+		options->tensor.scale[c] = 1.0f / (255.0f * std[c]);
+		options->tensor.bias[c] = -mean[c] / std[c];
+	}
+	if (options->tar_path != NULL && (options->mmap_output || options->memfd_target != NULL || options->direct_io || options->sparse || options->write_behind || options->ring))
+	{
+		fprintf(stderr, "Option --tar writes a stream and cannot be combined with other output modes.\n");
+		return ERROR_PARAMETER_INVALID;
+	}
+	// --memfd is --mmap into an anonymous sealed file that is handed to TARGET instead of a path
+	options->mmap_output = options->mmap_output || options->memfd_target != NULL;
+	return SUCCESS;
+}
+
+// Rows are converted independently into their own offsets of *lines, so with more than one
+// thread the image is split into bands interleaved across the threads; the output does not depend
+// on the thread count. *lines may be png_data itself (single thread only): output rows never
+// start past their input rows, so rows are converted front to back, except for expanding
+// conversions (palette), which run back to front from a copy of each input row.
+// *gray asks for gray detection on entry and tells whether the output was written as one gray
+// sample per pixel: gray palettes are looked up as gray directly, other RGB rows are scanned as
+// they are converted and packed at the end if every row was gray.
+// Every output row is pushed to `queue` when one is given: band by band in row order as soon as
+// the band and the ones before it are converted, as a whole at the end when the rows are converted
+// back to front or scanned for --auto-gray.
+// With a `ring` the rows are converted one by one into its slots instead of *lines, on one thread;
+// with a `writer` likewise into its aligned buffers (a row that straddles two buffers goes through
+// a row buffer).
+// With a `tensor` each row is converted into a per-thread row buffer and stored from there into
+// *lines in the tensor layout.
+int write_to_lines(
+	unsigned int width,
+	unsigned int height,
+	int bytes_pixel,
+	int bytes_pixel_out,
+	const char *png_data,
+	char color_type,
+	const unsigned char background[3],
+	int *pos,
+	char **lines,
+	struct chunk plte,
+	int go_trns,
+	struct chunk trns,
+	int keep_alpha,
+	int *gray,
+	int threads,
+	struct band_queue *queue,
+	struct row_ring *ring,
+	const struct tensor_format *tensor,
+	struct direct_writer *writer)
+{
+	struct conversion conversion;
+	struct convert_job jobs[MAX_THREADS];
+	unsigned char *scratch = NULL;
+	unsigned char *tensor_rows = NULL;
+	unsigned char *writer_row = NULL;
+	struct thread_task tasks[MAX_THREADS];
+	int started[MAX_THREADS] = { 0 };
+
+	unsigned long row_bytes = (unsigned long)width * (bytes_pixel + bytes_pixel_out) + 1;
+	unsigned int band_rows = row_bytes >= CONVERT_BAND_BYTES ? 1 : (unsigned int)(CONVERT_BAND_BYTES / row_bytes);
+	unsigned int bands = (height + band_rows - 1) / band_rows;
+	if (threads > (int)bands)
+	{
+		threads = bands > 0 ? (int)bands : 1;
+	}
+
+	row_kernel convert = prepare_conversion(color_type, plte, go_trns, trns, background, keep_alpha, &conversion);
+	if ((color_type == 4 || color_type == 6) && !keep_alpha && is_opaque_image(width, height, bytes_pixel, png_data))
+	{
+		convert = select_strip_alpha_kernel(color_type);
+	}
+	int scan_gray = *gray && bytes_pixel_out == 3;
+	*gray = 0;
+	if (scan_gray && color_type == 3 && is_gray_palette(&conversion.palette))
+	{
+		memcpy(conversion.gray.map, conversion.palette.planes[0], 256);
+		list_changed_gray(&conversion.gray);
+		convert = select_gray_kernel(&conversion.gray);
+		bytes_pixel_out = 1;
+		scan_gray = 0;
+		*gray = 1;
+	}
+
+	if (ring != NULL || writer != NULL)
+	{
+		threads = 1;
+	}
+	if (writer != NULL && allocate_vector(width * bytes_pixel_out, (char **)&writer_row) != SUCCESS)
+	{
+		return ERROR_OUT_OF_MEMORY;
+	}
+	// a tensor row buffer holds the converted row and one deinterleaved channel of it
+	unsigned long tensor_row_bytes = (unsigned long)width * (bytes_pixel_out + 1);
+	if (tensor != NULL && allocate_vector(threads * tensor_row_bytes, (char **)&tensor_rows) != SUCCESS)
+	{
+		free(writer_row);
+		return ERROR_OUT_OF_MEMORY;
+	}
+	if ((const char *)*lines == png_data)
+	{
+		threads = 1;
+		if (bytes_pixel_out > bytes_pixel && allocate_vector(width * bytes_pixel, (char **)&scratch) != SUCCESS)
+		{
+			free(tensor_rows);
+			return ERROR_OUT_OF_MEMORY;
+		}
+	}
+	if (queue != NULL && threads > 1 && !scan_gray)
+	{
+		if (allocate_vector(bands, (char **)&queue->ready) != SUCCESS)
+		{
+			free(tensor_rows);
+			return ERROR_OUT_OF_MEMORY;
+		}
+		memset(queue->ready, 0, bands);
+		queue->ready_bands = bands;
+		queue->next_band = 0;
+		queue->pushing = 0;
+	}
+
+	for (int t = 0; t < threads; t++)
+	{
+		jobs[t].convert = convert;
+		jobs[t].conversion = &conversion;
+		jobs[t].png_data = png_data;
+		jobs[t].out = *lines != NULL ? (unsigned char *)*lines + *pos : NULL;
+		jobs[t].width = width;
+		jobs[t].height = height;
+		jobs[t].bytes_pixel = bytes_pixel;
+		jobs[t].bytes_pixel_out = bytes_pixel_out;
+		jobs[t].band_rows = band_rows;
+		jobs[t].first_band = (unsigned int)t;
+		jobs[t].band_step = (unsigned int)threads;
+		jobs[t].scratch = scratch;
+		jobs[t].gray = scan_gray;
+		jobs[t].queue = scratch == NULL && !scan_gray ? queue : NULL;
+		jobs[t].ring = ring;
+		jobs[t].tensor = tensor;
+		jobs[t].tensor_row = tensor_rows != NULL ? tensor_rows + t * tensor_row_bytes : NULL;
+		jobs[t].writer = writer;
+		jobs[t].writer_row = writer_row;
+		tasks[t].func = convert_job_run;
+		tasks[t].arg = &jobs[t];
+	}
+	for (int t = 1; t < threads; t++)
+	{
+		if (start_task(&tasks[t]) == SUCCESS)
+		{
+			started[t] = 1;
+		}
+		else
+		{
+			convert_job_run(&jobs[t]);
+		}
+	}
+	convert_job_run(&jobs[0]);
+	for (int t = 1; t < threads; t++)
+	{
+		if (started[t])
+		{
+			join_task(&tasks[t]);
+		}
+	}
+	free(scratch);
+	free(tensor_rows);
+	free(writer_row);
+	if (queue != NULL)
+	{
+		free(queue->ready);
+		queue->ready = NULL;
+	}
+	if (ring != NULL && ring->failed)
+	{
+		return ERROR_UNKNOWN;
+	}
+	for (int t = 0; t < threads; t++)
+	{
+		scan_gray = scan_gray && jobs[t].gray;
+	}
+	if (scan_gray)
+	{
+		pack_gray(width, height, width * 3, (unsigned char *)*lines + *pos, (unsigned char *)*lines + *pos);
+		bytes_pixel_out = 1;
+		*gray = 1;
+	}
+	if (queue != NULL && jobs[0].queue == NULL)
+	{
+		unsigned long size = (unsigned long)height * width * bytes_pixel_out;
+		push_band(queue, *lines + *pos, size, size, 1);
+	}
+	*pos += (int)((unsigned long)height * width * bytes_pixel_out * (tensor != NULL && tensor->float32 ? sizeof(float) : 1));
+	return SUCCESS;
+}
+
+void *convert_job_run(void *arg)
+{
+	struct convert_job *job = arg;
+	size_t out_row = (size_t)job->width * job->bytes_pixel_out;
+	if (job->scratch != NULL)
+	{
+		for (unsigned int i = job->height; i-- > 0;)
+		{
+			memcpy(job->scratch, &ARR(job->png_data, i, 1, job->width * job->bytes_pixel + 1), (size_t)job->width * job->bytes_pixel);
+			job->convert(job->scratch, job->out + i * out_row, job->width, job->conversion);
+			job->gray = job->gray && is_gray_row(job->out + i * out_row, job->width);
+		}
+		return NULL;
+	}
+	for (unsigned long band = job->first_band; band * job->band_rows < job->height; band += job->band_step)
+	{
+		unsigned int end = job->height - band * job->band_rows > job->band_rows ? (unsigned int)(band + 1) * job->band_rows : job->height;
+		for (unsigned int i = (unsigned int)band * job->band_rows; i < end; i++)
+		{
+			const unsigned char *row = (const unsigned char *)&ARR(job->png_data, i, 1, job->width * job->bytes_pixel + 1);
+			if (job->tensor != NULL)
+			{
+				job->convert(row, job->tensor_row, job->width, job->conversion);
+				store_tensor_row(job->tensor_row, job->out, i, job->width, job->height, job->bytes_pixel_out, job->tensor, job->tensor_row + out_row);
+				continue;
+			}
+			if (job->ring != NULL)
+			{
+				unsigned char *slot = ring_slot(job->ring, i);
+				if (slot == NULL)
+				{
+					return NULL;
+				}
+				job->convert(row, slot, job->width, job->conversion);
+				ring_publish(job->ring, i);
+				continue;
+			}
+			if (job->writer != NULL)
+			{
+				unsigned char *reserved = (unsigned char *)direct_writer_reserve(job->writer, out_row);
+				job->convert(row, reserved != NULL ? reserved : job->writer_row, job->width, job->conversion);
+				int error_write = reserved != NULL ? direct_writer_commit(job->writer, out_row) : direct_writer_put(job->writer, (const char *)job->writer_row, out_row);
+				if (error_write != SUCCESS)
+				{
+					return NULL;
+				}
+				continue;
+			}
+			job->convert(row, job->out + i * out_row, job->width, job->conversion);
+			job->gray = job->gray && is_gray_row(job->out + i * out_row, job->width);
+		}
+		if (job->queue != NULL)
+		{
+			push_band_in_order(job, (unsigned int)band);
+		}
+	}
+	return NULL;
+}
+
+// 16-bit counterpart of write_to_lines for --16bit: samples, tRNS keys and alpha are compared and
+// blended at full precision, output samples are big-endian as PNM expects for maxval 65535.
+// With keep_alpha (PAM, gray and RGB with tRNS only) the samples are kept and the key match
+// becomes an alpha sample instead. Finished bands of rows are pushed to `queue` when one is given.
+void write_to_lines16(
+	unsigned int width,
+	unsigned int height,
+	int bytes_pixel,
+	int bytes_pixel_out,
+	const char *png_data,
+	char color_type,
+	const unsigned short background[3],
+	int *pos,
+	char **lines,
+	int go_trns,
+	struct chunk trns,
+	int keep_alpha,
+	struct band_queue *queue)
+{
+	int channels = bytes_pixel_out / 2 - keep_alpha;
+	unsigned long delm = width * bytes_pixel + 1;
+	unsigned long out_row = (unsigned long)width * bytes_pixel_out;
+	unsigned int band_rows = out_row >= CONVERT_BAND_BYTES ? 1 : (unsigned int)(CONVERT_BAND_BYTES / out_row);
+	int band_start = *pos;
+	for (unsigned int i = 0; i < height; i++)
+	{
+		if (queue != NULL && i > 0 && i % band_rows == 0)
+		{
+			push_band(queue, *lines + band_start, (unsigned long)(*pos - band_start), (unsigned long)(*pos - band_start), 1);
+			band_start = *pos;
+		}
+		for (unsigned int j = 0; j < width; j++)
+		{
+			const unsigned char *pixel = (const unsigned char *)&ARR(png_data, i, 1 + j * bytes_pixel, delm);
+			unsigned long alpha = 65535;
+			if (color_type == 6 || color_type == 4)
+			{
+				alpha = (pixel[2 * channels] << 8) | pixel[2 * channels + 1];
+			}
+			else if (go_trns)
+			{
+				for (unsigned int ti = 0; ti + 2 * channels <= trns.length; ti += 2 * channels)
+				{
+					if (memcmp(pixel, trns.data + ti, 2 * channels) == 0)
+					{
+						alpha = 0;
+						break;
+					}
+				}
+			}
+			if (keep_alpha)
+			{
+				memcpy(*lines + *pos, pixel, 2 * channels);
+				*pos += 2 * channels;
+				(*lines)[(*pos)++] = (char)(alpha >> 8);
+				(*lines)[(*pos)++] = (char)alpha;
+				continue;
+			}
+			for (int it = 0; it < channels; it++)
+			{
+				unsigned long long pix = (pixel[2 * it] << 8) | pixel[2 * it + 1];
+				unsigned long long out = (pix * alpha + (unsigned long long)background[it] * (65535 - alpha) + 32767) / 65535;
+				(*lines)[(*pos)++] = (char)(out >> 8);
+				(*lines)[(*pos)++] = (char)out;
+			}
+		}
+	}
+	if (queue != NULL && *pos > band_start)
+	{
+		push_band(queue, *lines + band_start, (unsigned long)(*pos - band_start), (unsigned long)(*pos - band_start), 1);
+	}
+}
+
+void change_background(int argc, char *argv[], char color_type, struct chunk plte, unsigned char background[], int *go_background, int go_bkgd, struct chunk bkgd)
+{
+	if (argc == 4)
+	{
+		unsigned char x = strtol(argv[3], NULL, 10);
+		if (color_type == 3)
+		{
+			if (x < plte.length / 3)
+			{
+				background[0] = ARR(plte.data, x, 0, 3);
+				background[1] = ARR(plte.data, x, 1, 3);
+				background[2] = ARR(plte.data, x, 2, 3);
+			}
+		}
+		else
+		{
+			background[0] = background[1] = background[2] = (char)x;
+		}
+		*go_background = 1;
+	}
+	else if (argc == 6)
+	{
+		for (int i = 0; i < 3; i++)
+		{
+			background[i] = (char)strtol(argv[3 + i], NULL, 10);
+		}
+		*go_background = 1;
+	}
+
+	if (!(*go_background) && go_bkgd)
+	{
+		if (color_type == 6 || color_type == 2)
+		{
+			background[0] = bkgd.data[1];
+			background[1] = bkgd.data[3];
+			background[2] = bkgd.data[5];
+		}
+		if (color_type == 0 || color_type == 4)
+		{
+			background[0] = background[1] = background[2] = bkgd.data[1];
+		}
+		if (color_type == 3)
+		{
+			unsigned char index_plte = bkgd.data[0];
+			background[0] = ARR(plte.data, index_plte, 0, 3);
+			background[1] = ARR(plte.data, index_plte, 1, 3);
 			background[2] = ARR(plte.data, index_plte, 2, 3);
 		}
 	}
 }
 
-int read_all_chunks(
-	FILE *input,
-	unsigned long crc_table[256],
-	unsigned long *i_data_len,
-	char **i_data,
-	struct chunk *plte,
-	int *plte_go,
-	int num_in_blocks,
-	struct chunk **in_blocks,
-	const enum chunk_type *name_in_blocks,
-	int *go_in_blocks)
+// Composites PLTE with the tRNS alphas onto the background once per image (with the same
+// formula as the composite kernels), so every palette pixel is a single table fetch.
+// Indices past the end of PLTE map to black.
+void make_palette(struct chunk plte, int go_trns, struct chunk trns, const unsigned char background[3], int keep_alpha, struct palette *palette)
+{
+	memset(palette, 0, sizeof(struct palette));
+	palette->size = plte.length / 3 < 256 ? plte.length / 3 : 256;
+	for (unsigned int index = 0; index < 256; index++)
+	{
+		unsigned int alpha = go_trns && index < trns.length ? (unsigned char)trns.data[index] : 255;
+		palette->rgbx[index][3] = (unsigned char)alpha;
+		for (int it = 0; it < 3 && index < palette->size; it++)
+		{
+			unsigned int color = (unsigned char)ARR(plte.data, index, it, 3);
+			if (!keep_alpha)
+			{
+				color = (color * alpha + background[it] * (255 - alpha) + 127) / 255;
+			}
+			palette->rgbx[index][it] = (unsigned char)color;
+			palette->planes[it][index] = palette->rgbx[index][it];
+		}
+	}
+}
+
+// Background for --16bit: the full bKGD samples, or the 8-bit background from the arguments.
+void change_background16(const unsigned char background[3], int go_background, char color_type, int go_bkgd, struct chunk bkgd, unsigned short background16[3])
+{
+	for (int i = 0; i < 3; i++)
+	{
+		background16[i] = (unsigned short)(background[i] * 257);
+	}
+	if (!go_background && go_bkgd)
+	{
+		for (int i = 0; i < 3; i++)
+		{
+			int sample = (color_type == 0 || color_type == 4) ? 0 : i;
+			background16[i] = (unsigned short)((unsigned char)ARR(bkgd.data, sample, 0, 2) << 8 | (unsigned char)ARR(bkgd.data, sample, 1, 2));
+		}
+	}
+}
+
+int read_all_chunks(
+	FILE *input,
+	unsigned long crc_table[256],
+	unsigned long *i_data_len,
+	char **i_data,
+	struct chunk *plte,
+	int *plte_go,
+	int num_in_blocks,
+	struct chunk **in_blocks,
+	const enum chunk_type *name_in_blocks,
+	int *go_in_blocks)
+{
+	int return_code = SUCCESS;
+	struct chunk chunk;
+	do
+	{
+		CHECK_ERROR(SUCCESS, read_chunk(input, &chunk, crc_table), read_chunk_error_check)
+		if (chunk.type == IHDR)
+		{
+			fprintf(stderr, "More than one IHDR chunk found - error.\n");
+			return_code = ERROR_DATA_INVALID;
+			goto end_read;
+		}
+		else if (chunk.type == PLTE)
+		{
+			if (!(*plte_go))
+			{
+				(*plte) = chunk;
+				*plte_go = 1;
+			}
+			else
+			{
+				fprintf(stderr, "More than one PLTE chunk found - error.\n");
+				return_code = ERROR_DATA_INVALID;
+				goto end_read;
+			}
+			continue;
+		}
+		else if (chunk.type == IDAT)
+		{
+			char *t;
+			unsigned long new_i_data_len = (*i_data_len) + chunk.length;
+			union_two((*i_data_len), (*i_data), chunk.length, chunk.data, &t);
+			free((*i_data));
+			(*i_data_len) = new_i_data_len;
+			(*i_data) = t;
+		}
+		else
+		{
+			int check_inp = 0;
+			for (int i = 0; i < num_in_blocks; i++)
+			{
+				if (name_in_blocks[i] == chunk.type)
+				{
+					check_inp = 1;
+					if (!go_in_blocks[i])
+					{
+						(*in_blocks)[i] = chunk;
+						go_in_blocks[i] = 1;
+					}
+					else
+					{
+						if (name_in_blocks[i] == tRNS)
+						{
+							char *tmp_in_block;
+							union_two((*in_blocks)[i].length, (*in_blocks)[i].data, chunk.length, chunk.data, &tmp_in_block);
+							free_chunk(chunk);
+							chunk.length = (*in_blocks)[i].length + chunk.length;
+							chunk.data = tmp_in_block;
+						}
+						free_chunk((*in_blocks)[i]);
+						(*in_blocks)[i] = chunk;
+					}
+				}
+			}
+			if (check_inp)
+			{
+				continue;
+			}
+		}
+		free_chunk(chunk);
+	} while (chunk.type != IEND);
+
+end_read:
+	if (return_code != SUCCESS)
+	{
+		if (*plte_go)
+		{
+			free_chunk(*plte);
+		}
+		for (int i = 0; i < num_in_blocks; i++)
+		{
+			if (go_in_blocks[i])
+			{
+				free_chunk(*(in_blocks[i]));
+			}
+		}
+	}
+	return return_code;
+}
+
+int read_chunk(FILE *input, struct chunk *chunk, const unsigned long *crc_table)
+{
+	unsigned int len;
+	char len_inp[4];
+	char type_inp[4];
+	char *data;
+	unsigned int crc1;
+	char crc_inp[4];
+	enum chunk_type type;
+
+	CHECK_ERROR(SUCCESS, read_nbytes_file(len_inp, 4, input), read_nbytes_file_error_length)
+
+	len = make_int_chars4(len_inp);
+
+	CHECK_ERROR(SUCCESS, read_nbytes_file(type_inp, 4, input), read_nbytes_file_error_type)
+	type = change_type_chunk(type_inp);
+
+	CHECK_ERROR(SUCCESS, allocate_vector(len, &data), alloc_vec)
+	CHECK_ERROR_WITH_FREE(SUCCESS, read_nbytes_file(data, len, input), read_nbytes_file_error_data, free(data))
+
+	CHECK_ERROR_WITH_FREE(SUCCESS, read_nbytes_file(crc_inp, 4, input), read_nbytes_file_error_crc, free(data))
+
+	crc1 = make_int_chars4(crc_inp);
+	unsigned int crc2;
+	CHECK_ERROR_WITH_FREE(SUCCESS, crc(&crc2, crc_table, (unsigned char *)type_inp, (unsigned char *)data, len), crc_compute, free(data))
+	if (crc1 != crc2 && type < 3)
+	{
+		fprintf(stderr, "No good crc for main chunk.\n");
+		free(data);
+		return ERROR_DATA_INVALID;
+	}
+
+	chunk->length = len;
+	chunk->type = type;
+	chunk->data = data;
+
+	return SUCCESS;
+}
+
+enum chunk_type change_type_chunk(char inp[4])
+{
+	for (int i = 0; i < COUNT_CHUNK_TYPES - 1; i++)
+	{
+		if (check_equal_array(4, inp, PNG_CHUNKS_SIGNATURE[i]))
+		{
+			return (enum chunk_type)i;
+		}
+	}
+	return ANOTHER;
+}
+
+void unfilter_png(unsigned int width, unsigned int height, int bytes_pixel, char *png_data)
+{
+	unsigned long delm = width * bytes_pixel + 1;
+
+	for (int i = 0; i < height; i++)
+	{
+		enum filter_type filter = (enum filter_type)ARR(png_data, i, 0, delm);
+
+		if (filter == NONE)
+			continue;
+		for (int j = 1; j < width * bytes_pixel + 1; j++)
+		{
+			unsigned char a_byte = (j - bytes_pixel >= 1 ? ARR(png_data, i, j - bytes_pixel, delm) : 0);
+			unsigned char b_byte = (i - 1 >= 0 ? ARR(png_data, i - 1, j, delm) : 0);
+			unsigned char c_byte = (i - 1 >= 0 && j - bytes_pixel >= 1 ? ARR(png_data, i - 1, j - bytes_pixel, delm) : 0);
+			if (filter == SUB)
+			{
+				ARR(png_data, i, j, delm) += a_byte;
+			}
+			else if (filter == UP)
+			{
+				ARR(png_data, i, j, delm) += b_byte;
+			}
+			else if (filter == AVERAGE)
+			{
+				ARR(png_data, i, j, delm) += floor(((double)a_byte + (double)b_byte) / 2.0);
+			}
+			else if (filter == PAETH)
+			{
+				int p_byte = (int)a_byte + (int)b_byte - (int)c_byte;
+				int pa = abs(p_byte - (int)a_byte);
+				int pb = abs(p_byte - (int)b_byte);
+				int pc = abs(p_byte - (int)c_byte);
+				unsigned char rec;
+				if (pa <= pb && pa <= pc)
+				{
+					rec = a_byte;
+				}
+				else if (pb <= pc)
+				{
+					rec = b_byte;
+				}
+				else
+				{
+					rec = c_byte;
+				}
+				ARR(png_data, i, j, delm) += rec;
+			}
+		}
+	}
+}
+
+// Unfilters rows of `bits_pixel`-bit pixels; sub-byte pixels are filtered byte by byte.
+void unfilter_packed_png(unsigned int width, unsigned int height, int bits_pixel, char *png_data)
+{
+	int filter_bytes = (bits_pixel + 7) / 8;
+	unfilter_png(packed_row_bytes(width, bits_pixel) / filter_bytes, height, filter_bytes, png_data);
+}
+
+// table[b] holds the 8 / bit_depth samples packed into byte b, most significant first.
+// Gray samples are scaled to the full 0..255 range, palette indices are kept as is.
+void make_unpack_table(int bit_depth, int scale, unsigned char table[256][8])
+{
+	int max = (1 << bit_depth) - 1;
+	for (int b = 0; b < 256; b++)
+	{
+		for (int k = 0; k < 8 / bit_depth; k++)
+		{
+			int sample = (b >> (8 - bit_depth * (k + 1))) & max;
+			table[b][k] = (unsigned char)(scale ? sample * 255 / max : sample);
+		}
+	}
+}
+
+// Expands packed sub-byte rows of src into one byte per pixel in dst (same row layout with the
+// filter byte). Runs back to front, so dst may be the same buffer as src.
+void unpack_png(unsigned int width, unsigned int height, int bit_depth, const unsigned char table[256][8], const char *src, char *dst)
+{
+	int per_byte = 8 / bit_depth;
+	unsigned long row_bytes = packed_row_bytes(width, bit_depth);
+	unsigned long delm = width + 1;
+	for (unsigned int i = height; i-- > 0;)
+	{
+		const unsigned char *in = (const unsigned char *)&ARR(src, i, 1, row_bytes + 1);
+		char *out = &ARR(dst, i, 1, delm);
+		unsigned long k = row_bytes;
+		unsigned int tail = width % per_byte;
+		if (tail != 0)
+		{
+			k--;
+			memmove(out + k * per_byte, table[in[k]], tail);
+		}
+		while (k-- > 0)
+		{
+			memmove(out + k * per_byte, table[in[k]], per_byte);
+		}
+		ARR(dst, i, 0, delm) = NONE;
+	}
+}
+
+// Rescales the 2-byte samples of a bKGD or tRNS chunk to 8 bits the same way unpack_png and
+// downconvert_png do, so they keep comparing equal to the converted pixels.
+void scale_sample_chunk(int bit_depth, struct chunk chunk)
+{
+	int max = (1 << bit_depth) - 1;
+	for (unsigned int i = 0; i + 1 < chunk.length; i += 2)
+	{
+		unsigned long sample = (unsigned char)ARR(chunk.data, i / 2, 0, 2) << 8 | (unsigned char)ARR(chunk.data, i / 2, 1, 2);
+		ARR(chunk.data, i / 2, 1, 2) = (char)(bit_depth == 16 ? (sample * 255 + 32895) >> 16 : (sample & max) * 255 / max);
+		ARR(chunk.data, i / 2, 0, 2) = 0;
+	}
+}
+
+// Converts unfiltered 16-bit rows to 8 bits in place. With a tRNS chunk, every pixel gets an
+// alpha byte (0 for pixels equal to one of the 16-bit keys, 255 otherwise), turning gray into
+// gray+alpha and RGB into RGBA.
+void downconvert_png(unsigned int width, unsigned int height, int channels, const struct chunk *trns, char *png_data)
+{
+	int bytes_in = channels * 2;
+	int bytes_out = channels + (trns != NULL);
+	unsigned long delm_in = width * bytes_in + 1;
+	unsigned long delm_out = width * bytes_out + 1;
+	for (unsigned int i = 0; i < height; i++)
+	{
+		const unsigned char *in = (const unsigned char *)&ARR(png_data, i, 1, delm_in);
+		unsigned char *out = (unsigned char *)&ARR(png_data, i, 1, delm_out);
+		ARR(png_data, i, 0, delm_out) = NONE;
+		if (trns == NULL)
+		{
+			downconvert_samples(in, out, (unsigned long)width * channels);
+			continue;
+		}
+		for (unsigned int j = 0; j < width; j++)
+		{
+			unsigned char alpha = 255;
+			for (unsigned int ti = 0; ti + bytes_in <= trns->length; ti += bytes_in)
+			{
+				if (memcmp(in + j * bytes_in, trns->data + ti, bytes_in) == 0)
+				{
+					alpha = 0;
+					break;
+				}
+			}
+			downconvert_samples(in + j * bytes_in, out + j * bytes_out, channels);
+			out[j * bytes_out + channels] = alpha;
+		}
+	}
+}
+
+// Rounds big-endian 16-bit samples to 8 bits: v * 255 / 65535 = h + (l - h) / 257 for v = 257 * h + (l - h),
+// so the result is the high byte, corrected by one when the low byte differs from it by more than 128.
+// Safe in place (out <= in).
+void downconvert_samples(const unsigned char *in, unsigned char *out, unsigned long count)
+{
+	unsigned long k = 0;
+#if defined(HAVE_SSE2)
+	const __m128i low_mask = _mm_set1_epi16(0x00FF);
+	const __m128i up_limit = _mm_set1_epi16(128);
+	const __m128i down_limit = _mm_set1_epi16(-128);
+	for (; k + 16 <= count; k += 16)
+	{
+		__m128i rounded[2];
+		for (int half = 0; half < 2; half++)
+		{
+			__m128i v = _mm_loadu_si128((const __m128i *)(in + 2 * k + 16 * half));
+			__m128i h = _mm_and_si128(v, low_mask);
+			__m128i d = _mm_sub_epi16(_mm_srli_epi16(v, 8), h);
+			rounded[half] = _mm_add_epi16(_mm_sub_epi16(h, _mm_cmpgt_epi16(d, up_limit)), _mm_cmplt_epi16(d, down_limit));
+		}
+		_mm_storeu_si128((__m128i *)(out + k), _mm_packus_epi16(rounded[0], rounded[1]));
+	}
+#endif
+	for (; k < count; k++)
+	{
+		int h = in[2 * k];
+		int l = in[2 * k + 1];
+		out[k] = (unsigned char)(h + (l - h > 128) - (h - l > 128));
+	}
+}
+
+void *unfilter_job_run(void *arg)
+{
+	struct unfilter_job *job = arg;
+	unfilter_packed_png(job->width, job->height, job->bits_pixel, job->data);
+	if (job->unpack_table != NULL)
+	{
+		unpack_png(job->width, job->height, job->bits_pixel, job->unpack_table, job->data, job->unpacked);
+	}
+	return NULL;
+}
+
+// Unfilters the first `passes` Adam7 sub-images of the inflated stream in *png_data and replaces
+// it with a non-interlaced image in the usual layout (every row prefixed by a NONE filter byte).
+// With fewer than seven passes the result is the reduced preview image (see PREVIEW_SX/SY).
+// The passes are independent after inflation, so large images unfilter them in parallel.
+// Sub-byte passes are unpacked (with unpack_table) into a separate buffer before the scatter.
+int deinterlace_png(unsigned int width, unsigned int height, int bits_pixel, int passes, const unsigned char unpack_table[256][8], char **png_data)
+{
+	char *pass_data[ADAM7_PASSES];
+	struct unfilter_job jobs[ADAM7_PASSES];
+	struct thread_task tasks[ADAM7_PASSES];
+	int started[ADAM7_PASSES] = { 0 };
+	int parallel = adam7_data_size(width, height, bits_pixel, passes) >= PARALLEL_UNFILTER_MIN_BYTES;
+	int bytes_pixel = unpack_table != NULL ? 1 : bits_pixel / 8;
+
+	char *unpacked = NULL;
+	if (unpack_table != NULL)
+	{
+		CHECK_ERROR(SUCCESS, allocate_vector(adam7_data_size(width, height, 8, passes), &unpacked), allocate_unpacked)
+	}
+
+	char *cur = *png_data;
+	char *cur_unpacked = unpacked;
+	for (int p = 0; p < passes; p++)
+	{
+		jobs[p].width = adam7_pass_width(width, p);
+		jobs[p].height = adam7_pass_height(height, p);
+		jobs[p].bits_pixel = bits_pixel;
+		jobs[p].data = pass_data[p] = cur;
+		jobs[p].unpack_table = unpack_table;
+		jobs[p].unpacked = cur_unpacked;
+		if (jobs[p].width == 0 || jobs[p].height == 0)
+		{
+			continue;
+		}
+		cur += image_data_size(jobs[p].width, jobs[p].height, bits_pixel);
+		if (unpacked != NULL)
+		{
+			pass_data[p] = cur_unpacked;
+			cur_unpacked += image_data_size(jobs[p].width, jobs[p].height, 8);
+		}
+
+		tasks[p].func = unfilter_job_run;
+		tasks[p].arg = &jobs[p];
+		if (parallel && start_task(&tasks[p]) == SUCCESS)
+		{
+			started[p] = 1;
+		}
+		else
+		{
+			unfilter_job_run(&jobs[p]);
+		}
+	}
+	for (int p = 0; p < passes; p++)
+	{
+		if (started[p])
+		{
+			join_task(&tasks[p]);
+		}
+	}
+
+	unsigned int image_width = (width + PREVIEW_SX[passes - 1] - 1) / PREVIEW_SX[passes - 1];
+	unsigned int image_height = (height + PREVIEW_SY[passes - 1] - 1) / PREVIEW_SY[passes - 1];
+	char *image;
+	CHECK_ERROR_WITH_FREE(SUCCESS, allocate_vector(image_data_size(image_width, image_height, bytes_pixel * 8), &image), allocate_image, free(unpacked))
+	scatter_adam7(width, height, bytes_pixel, passes, pass_data, image);
+	free(unpacked);
+	free(*png_data);
+	*png_data = image;
+	return SUCCESS;
+}
+
+// Scatters the first `passes` unfiltered passes into the final image one 8-row band and
+// ADAM7_TILE-pixel column tile at a time, so every destination tile stays in cache while all
+// passes are written into it and every pass is read sequentially. Pixels of the first passes
+// lie on a PREVIEW_SX x PREVIEW_SY grid, which becomes the (reduced) destination image.
+void scatter_adam7(unsigned int width, unsigned int height, int bytes_pixel, int passes, char *const pass_data[ADAM7_PASSES], char *image)
+{
+	unsigned int sx = PREVIEW_SX[passes - 1];
+	unsigned int sy = PREVIEW_SY[passes - 1];
+	unsigned long delm = ((width + sx - 1) / sx) * bytes_pixel + 1;
+	for (unsigned int i = 0; i < (height + sy - 1) / sy; i++)
+	{
+		ARR(image, i, 0, delm) = NONE;
+	}
+
+	for (unsigned int band = 0; band < height; band += 8)
+	{
+		unsigned int band_end = band + 8 < height ? band + 8 : height;
+		for (unsigned int tile = 0; tile < width; tile += ADAM7_TILE)
+		{
+			unsigned int tile_end = tile + ADAM7_TILE < width ? tile + ADAM7_TILE : width;
+			for (int p = 0; p < passes; p++)
+			{
+				unsigned int pass_width = adam7_pass_width(width, p);
+				if (pass_width == 0 || tile_end <= ADAM7_X0[p])
+				{
+					continue;
+				}
+				unsigned long pass_delm = pass_width * bytes_pixel + 1;
+				unsigned int first_col = tile > ADAM7_X0[p] ? (tile - ADAM7_X0[p] + ADAM7_DX[p] - 1) / ADAM7_DX[p] : 0;
+				unsigned int last_col = (tile_end - ADAM7_X0[p] + ADAM7_DX[p] - 1) / ADAM7_DX[p];
+				for (unsigned int y = band + ADAM7_Y0[p]; y < band_end; y += ADAM7_DY[p])
+				{
+					const char *src = &ARR(pass_data[p], (y - ADAM7_Y0[p]) / ADAM7_DY[p], 1, pass_delm);
+					char *dst = &ARR(image, y / sy, 1, delm);
+					if (ADAM7_DX[p] == 1)
+					{
+						memcpy(dst + tile * bytes_pixel, src + tile * bytes_pixel, (tile_end - tile) * bytes_pixel);
+						continue;
+					}
+					for (unsigned int c = first_col; c < last_col; c++)
+					{
+						memcpy(dst + ((ADAM7_X0[p] + c * ADAM7_DX[p]) / sx) * bytes_pixel, src + c * bytes_pixel, bytes_pixel);
+					}
+				}
+			}
+		}
+	}
+}
+
+// Reduces an unfiltered non-interlaced image in place to the grid the first `passes` Adam7
+// passes would cover, so previews of non-interlaced inputs match the interlaced ones.
+void subsample_png(unsigned int width, unsigned int height, int bytes_pixel, int passes, char *png_data)
+{
+	unsigned int sx = PREVIEW_SX[passes - 1];
+	unsigned int sy = PREVIEW_SY[passes - 1];
+	unsigned long delm = width * bytes_pixel + 1;
+	unsigned long preview_delm = ((width + sx - 1) / sx) * bytes_pixel + 1;
+	for (unsigned int i = 0; i < (height + sy - 1) / sy; i++)
+	{
+		ARR(png_data, i, 0, preview_delm) = NONE;
+		for (unsigned int j = 0; j < (width + sx - 1) / sx; j++)
+		{
+			memmove(&ARR(png_data, i, 1 + j * bytes_pixel, preview_delm), &ARR(png_data, i * sy, 1 + j * sx * bytes_pixel, delm), bytes_pixel);
+		}
+	}
+}
+
+// Gray and RGB images without tRNS need no pixel transformation: the PNM payload is exactly
+// the unfiltered rows without their filter byte, so they can be written straight from png_data.
+// PAM output keeps alpha, so gray+alpha and RGBA rows are written as they are too.
+int is_direct_output(char color_type, int go_trns, int keep_alpha)
+{
+	return (color_type == 0 || color_type == 2 || (keep_alpha && (color_type == 4 || color_type == 6))) && !go_trns;
+}
+
+// PAM channels: gray or RGB, plus alpha from the image or expanded from tRNS.
+int pam_depth(char color_type, int go_trns)
+{
+	int color_channels = (color_type == 0 || color_type == 4) ? 1 : 3;
+	return color_channels + (color_type == 4 || color_type == 6 || go_trns);
+}
+
+unsigned long write_rows_direct(FILE *output, unsigned int width, unsigned int height, int bytes_pixel, const char *png_data)
+{
+	unsigned long row_len = width * bytes_pixel;
+	unsigned long delm = row_len + 1;
+	unsigned long written = 0;
+#if defined(_WIN32)
+	for (unsigned int i = 0; i < height; i++)
+	{
+		written += fwrite(&ARR(png_data, i, 1, delm), sizeof(char), row_len, output);
+	}
+#else
+	if (fflush(output) != 0)
+	{
+		return 0;
+	}
+	int fd = fileno(output);
+	struct iovec iov[IOV_BATCH];
+	unsigned int row = 0;
+	while (row < height)
+	{
+		int count = 0;
+		for (; count < IOV_BATCH && row + count < height; count++)
+		{
+			iov[count].iov_base = (void *)&ARR(png_data, row + count, 1, delm);
+			iov[count].iov_len = row_len;
+		}
+		row += count;
+
+		int first = 0;
+		while (first < count)
+		{
+			ssize_t n = writev(fd, iov + first, count - first);
+			if (n < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+				return written;
+			}
+			written += n;
+			while (first < count && (size_t)n >= iov[first].iov_len)
+			{
+				n -= (ssize_t)iov[first].iov_len;
+				first++;
+			}
+			if (first < count)
+			{
+				iov[first].iov_base = (char *)iov[first].iov_base + n;
+				iov[first].iov_len -= n;
+			}
+		}
+	}
+#endif
+	return written;
+}
+
+// ---- OUTPUT ----
+// PNM (P5/P6) or PAM (P7) header. P5 and P6 headers have the same length, so a header written
+// before --auto-gray decided can be replaced in place.
+int format_header(char header[MAX_HEADER], unsigned int width, unsigned int height, int bytes_pixel_out, int keep_16bit, int keep_alpha, int gray_output)
+{
+	int maxval = keep_16bit ? 65535 : 255;
+	if (keep_alpha)
+	{
+		int depth = bytes_pixel_out / (keep_16bit ? 2 : 1);
+		const char *format = "P7\nWIDTH %u\nHEIGHT %u\nDEPTH %d\nMAXVAL %d\nTUPLTYPE %s\nENDHDR\n";
+		return snprintf(header, MAX_HEADER, format, width, height, depth, maxval, PAM_TUPLE_TYPES[depth - 1]);
+	}
+	return snprintf(header, MAX_HEADER, "P%c\n%u %u\n%d\n", gray_output ? '5' : '6', width, height, maxval);
+}
+
+void copy_rows_direct(unsigned int width, unsigned int height, int bytes_pixel, const char *png_data, char *out)
+{
+	unsigned long row_len = width * bytes_pixel;
+	for (unsigned int i = 0; i < height; i++)
+	{
+		memcpy(out + i * row_len, &ARR(png_data, i, 1, row_len + 1), row_len);
+	}
+}
+
+// Creates `path` with `size` bytes allocated on disk (posix_fallocate, or ftruncate where the
+// file system cannot preallocate) and maps it shared for writing. With `memfd` the file is an
+// anonymous memory file named `path` that can be sealed later (Linux only).
+int map_output(const char *path, unsigned long size, int memfd, int *fd, char **map)
+{
+#if defined(_WIN32)
+	(void)size;
+	(void)memfd;
+	(void)fd;
+	(void)map;
+	fprintf(stderr, "Output mapping is not supported on this platform, \"%s\" is not written.\n", path);
+	return ERROR_UNSUPPORTED;
+#else
+	if (memfd)
+	{
+#if defined(MFD_ALLOW_SEALING)
+		*fd = memfd_create(path, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+		fprintf(stderr, "Sealed memory files are not supported on this platform.\n");
+		return ERROR_UNSUPPORTED;
+#endif
+	}
+	else
+	{
+		*fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	}
+	if (*fd < 0)
+	{
+		ERROR_MESSAGE_CANNOT_OPEN_FILE(path, "rw", ERROR_CANNOT_OPEN_FILE)
+	}
+	int error_allocate = memfd ? EOPNOTSUPP : posix_fallocate(*fd, 0, (off_t)size);
+	if (error_allocate == EINVAL || error_allocate == EOPNOTSUPP)
+	{
+		error_allocate = ftruncate(*fd, (off_t)size) == 0 ? 0 : errno;
+	}
+	if (error_allocate != 0)
+	{
+		fprintf(stderr, "Cannot allocate %lu bytes for \"%s\": %s.\n", size, path, strerror(error_allocate));
+		close(*fd);
+		return ERROR_CANNOT_OPEN_FILE;
+	}
+	void *mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+	if (mapped == MAP_FAILED)
+	{
+		fprintf(stderr, "Cannot map \"%s\": %s.\n", path, strerror(errno));
+		close(*fd);
+		return ERROR_CANNOT_OPEN_FILE;
+	}
+	*map = mapped;
+	return SUCCESS;
+#endif
+}
+
+// Unmaps the output and cuts the file to the `size` bytes actually produced. A memory file is
+// then sealed against any change and sent to `send_to` (see send_output_fd).
+int unmap_output(int fd, char *map, unsigned long mapped_size, unsigned long size, const char *send_to)
+{
+#if defined(_WIN32)
+	(void)fd;
+	(void)map;
+	(void)mapped_size;
+	(void)size;
+	(void)send_to;
+	return ERROR_UNSUPPORTED;
+#else
+	int return_code = SUCCESS;
+	if (munmap(map, mapped_size) != 0 || (size < mapped_size && ftruncate(fd, (off_t)size) != 0))
+	{
+		fprintf(stderr, "Error write in output file: %s.\n", strerror(errno));
+		return_code = ERROR_UNKNOWN;
+	}
+#if defined(F_ADD_SEALS)
+	if (return_code == SUCCESS && send_to != NULL && fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0)
+	{
+		fprintf(stderr, "Cannot seal the output: %s.\n", strerror(errno));
+		return_code = ERROR_UNKNOWN;
+	}
+#endif
+	if (return_code == SUCCESS && send_to != NULL)
+	{
+		return_code = send_output_fd(fd, send_to);
+	}
+	if (close(fd) != 0)
+	{
+		return_code = ERROR_UNKNOWN;
+	}
+	return return_code;
+#endif
+}
+
+// Passes `fd` with SCM_RIGHTS over a Unix socket: "fd:N" is an inherited connected socket,
+// anything else the path of a listening one. The one byte message is 'P'. tools/memfd_receiver.py
+// is a receiver that checks the descriptor against a file conversion.
+int send_output_fd(int fd, const char *target)
+{
+#if defined(_WIN32)
+	(void)fd;
+	(void)target;
+	return ERROR_UNSUPPORTED;
+#else
+	int sock;
+	int inherited_sock = strncmp(target, "fd:", 3) == 0;
+	if (inherited_sock)
+	{
+		char *end = NULL;
+		long inherited = strtol(target + 3, &end, 10);
+		if (end == target + 3 || *end != '\0' || inherited < 0)
+		{
+			fprintf(stderr, "Invalid --memfd target \"%s\".\n", target);
+			return ERROR_PARAMETER_INVALID;
+		}
+		sock = (int)inherited;
+	}
+	else
+	{
+		struct sockaddr_un address;
+		memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		if (strlen(target) >= sizeof(address.sun_path))
+		{
+			fprintf(stderr, "Socket path \"%s\" is too long.\n", target);
+			return ERROR_PARAMETER_INVALID;
+		}
+		strcpy(address.sun_path, target);
+		sock = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (sock < 0 || connect(sock, (struct sockaddr *)&address, sizeof(address)) != 0)
+		{
+			fprintf(stderr, "Cannot connect to \"%s\": %s.\n", target, strerror(errno));
+			if (sock >= 0)
+			{
+				close(sock);
+			}
+			return ERROR_CANNOT_OPEN_FILE;
+		}
+	}
+
+	char byte = 'P';
+	struct iovec iov = { &byte, 1 };
+	union
+	{
+		struct cmsghdr align;
+		char data[CMSG_SPACE(sizeof(int))];
+	} control;
+	memset(&control, 0, sizeof(control));
+	struct msghdr message;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+	message.msg_control = control.data;
+	message.msg_controllen = sizeof(control.data);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	ssize_t sent;
+	do
+	{
+		sent = sendmsg(sock, &message, 0);
+	} while (sent < 0 && errno == EINTR);
+	int return_code = SUCCESS;
+	if (sent != 1)
+	{
+		fprintf(stderr, "Cannot send the output to \"%s\": %s.\n", target, strerror(errno));
+		return_code = ERROR_UNKNOWN;
+	}
+	if (!inherited_sock)
+	{
+		close(sock);
+	}
+	return return_code;
+#endif
+}
+
+// Opens `path` for writing, around the page cache if `direct`. File systems that refuse O_DIRECT
+// (tmpfs) get a plain descriptor, the buffers are written the same way.
+int open_direct_writer(const char *path, int direct, int sparse, struct direct_writer *writer)
+{
+#if defined(_WIN32)
+	(void)direct;
+	(void)sparse;
+	(void)writer;
+	fprintf(stderr, "Direct and sparse output are not supported on this platform, \"%s\" is not written.\n", path);
+	return ERROR_UNSUPPORTED;
+#else
+	int flags = O_WRONLY | O_CREAT | O_TRUNC;
+#if defined(O_DIRECT)
+	writer->fd = open(path, direct ? flags | O_DIRECT : flags, 0666);
+	if (writer->fd < 0 && direct && errno == EINVAL)
+	{
+		writer->fd = open(path, flags, 0666);
+	}
+#else
+	writer->fd = open(path, flags, 0666);
+#if defined(F_NOCACHE)
+	if (writer->fd >= 0 && direct)
+	{
+		fcntl(writer->fd, F_NOCACHE, 1);
+	}
+#endif
+#endif
+	if (writer->fd < 0)
+	{
+		ERROR_MESSAGE_CANNOT_OPEN_FILE(path, "wb", ERROR_CANNOT_OPEN_FILE)
+	}
+	writer->buffers[0] = writer->buffers[1] = NULL;
+	if (posix_memalign((void **)&writer->buffers[0], DIRECT_ALIGN, DIRECT_BUFFER_BYTES) != 0 ||
+		posix_memalign((void **)&writer->buffers[1], DIRECT_ALIGN, DIRECT_BUFFER_BYTES) != 0)
+	{
+		free(writer->buffers[0]);
+		close(writer->fd);
+		ERROR_MESSAGE_OUT_OF_MEMORY("direct output buffers", ERROR_OUT_OF_MEMORY)
+	}
+	writer->sparse = sparse;
+	writer->current = 0;
+	writer->used = 0;
+	writer->offset = 0;
+	writer->size = 0;
+	writer->queued = 0;
+	writer->closed = 0;
+	writer->error = SUCCESS;
+	writer->job.error = SUCCESS;
+	init_signal(&writer->signal);
+	writer->task.func = direct_writer_run;
+	writer->task.arg = writer;
+	writer->started = start_task(&writer->task) == SUCCESS;
+	return SUCCESS;
+#endif
+}
+
+int direct_writer_put(struct direct_writer *writer, const char *data, unsigned long len)
+{
+	while (len > 0 && writer->error == SUCCESS)
+	{
+		unsigned long chunk = DIRECT_BUFFER_BYTES - writer->used;
+		chunk = chunk < len ? chunk : len;
+		memcpy(writer->buffers[writer->current] + writer->used, data, chunk);
+		data += chunk;
+		len -= chunk;
+		direct_writer_commit(writer, chunk);
+	}
+	return writer->error;
+}
+
+// Room for `len` more bytes in the current buffer, to be filled in place and then counted with
+// direct_writer_commit; NULL when they do not fit (or after an error), direct_writer_put them then.
+char *direct_writer_reserve(struct direct_writer *writer, unsigned long len)
+{
+	return writer->error == SUCCESS && DIRECT_BUFFER_BYTES - writer->used >= len ? writer->buffers[writer->current] + writer->used : NULL;
+}
+
+int direct_writer_commit(struct direct_writer *writer, unsigned long len)
+{
+	writer->used += len;
+	writer->size += len;
+	if (writer->used == DIRECT_BUFFER_BYTES)
+	{
+		direct_writer_flush(writer, 0);
+	}
+	return writer->error;
+}
+
+// Hands the current buffer (rounded up to DIRECT_ALIGN, zero-padded) to the writer task once the
+// previous write has finished, and switches to the other buffer. `wait` also waits for this write.
+int direct_writer_flush(struct direct_writer *writer, int wait)
+{
+	if (writer->started)
+	{
+		lock_signal(&writer->signal);
+		while (writer->queued)
+		{
+			wait_signal(&writer->signal);
+		}
+		unlock_signal(&writer->signal);
+	}
+	writer->error = writer->error == SUCCESS ? writer->job.error : writer->error;
+	if (writer->used > 0 && writer->error == SUCCESS)
+	{
+		unsigned long len = (writer->used + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+		memset(writer->buffers[writer->current] + writer->used, 0, len - writer->used);
+		writer->job.fd = writer->fd;
+		writer->job.data = writer->buffers[writer->current];
+		writer->job.len = len;
+		writer->job.offset = writer->offset;
+		writer->job.sparse = writer->sparse;
+		if (writer->started)
+		{
+			lock_signal(&writer->signal);
+			writer->queued = 1;
+			notify_signal(&writer->signal);
+			while (wait && writer->queued)
+			{
+				wait_signal(&writer->signal);
+			}
+			unlock_signal(&writer->signal);
+		}
+		else
+		{
+			direct_write_run(&writer->job);
+		}
+		if (wait || !writer->started)
+		{
+			writer->error = writer->job.error;
+		}
+		writer->offset += len;
+		writer->current ^= 1;
+		writer->used = 0;
+	}
+	return writer->error;
+}
+
+int close_direct_writer(struct direct_writer *writer)
+{
+#if defined(_WIN32)
+	(void)writer;
+	return ERROR_UNSUPPORTED;
+#else
+	// a sparse file may end in a hole that was never written
+	int return_code = direct_writer_flush(writer, 1);
+	if (writer->started)
+	{
+		lock_signal(&writer->signal);
+		writer->closed = 1;
+		notify_signal(&writer->signal);
+		unlock_signal(&writer->signal);
+		join_task(&writer->task);
+	}
+	destroy_signal(&writer->signal);
+	if (return_code == SUCCESS && (writer->offset > writer->size || writer->sparse) && ftruncate(writer->fd, (off_t)writer->size) != 0)
+	{
+		fprintf(stderr, "Error write in output file: %s.\n", strerror(errno));
+		return_code = ERROR_UNKNOWN;
+	}
+	if (close(writer->fd) != 0 && return_code == SUCCESS)
+	{
+		return_code = ERROR_UNKNOWN;
+	}
+	free(writer->buffers[0]);
+	free(writer->buffers[1]);
+	return return_code;
+#endif
+}
+
+// Writer task: writes each queued buffer and hands it back until the writer is closed.
+void *direct_writer_run(void *arg)
+{
+	struct direct_writer *writer = arg;
+	lock_signal(&writer->signal);
+	for (;;)
+	{
+		while (!writer->queued && !writer->closed)
+		{
+			wait_signal(&writer->signal);
+		}
+		if (!writer->queued)
+		{
+			break;
+		}
+		unlock_signal(&writer->signal);
+		direct_write_run(&writer->job);
+		lock_signal(&writer->signal);
+		writer->queued = 0;
+		notify_signal(&writer->signal);
+	}
+	unlock_signal(&writer->signal);
+	return NULL;
+}
+
+void *direct_write_run(void *arg)
+{
+	struct direct_write *job = arg;
+	job->error = SUCCESS;
+#if !defined(_WIN32)
+	unsigned long done = 0;
+	while (done < job->len)
+	{
+		// len is a multiple of DIRECT_ALIGN; a sparse write covers one run of nonzero blocks at a time
+		unsigned long end = job->len;
+		if (job->sparse)
+		{
+			while (done < job->len && is_zero_block((const unsigned char *)job->data + done, DIRECT_ALIGN))
+			{
+				done += DIRECT_ALIGN;
+			}
+			end = done;
+			while (end < job->len && !is_zero_block((const unsigned char *)job->data + end, DIRECT_ALIGN))
+			{
+				end += DIRECT_ALIGN;
+			}
+			if (done == end)
+			{
+				break;
+			}
+		}
+		while (done < end)
+		{
+			ssize_t n = pwrite(job->fd, job->data + done, end - done, (off_t)(job->offset + done));
+			if (n < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			if (n <= 0)
+			{
+				fprintf(stderr, "Error write in output file: %s.\n", n < 0 ? strerror(errno) : "no space");
+				job->error = ERROR_UNKNOWN;
+				return NULL;
+			}
+			done += n;
+		}
+	}
+#endif
+	return NULL;
+}
+
+// `len` is a multiple of 64 and `block` is 16-byte aligned.
+int is_zero_block(const unsigned char *block, unsigned long len)
+{
+#if defined(HAVE_SSE2)
+	__m128i any = _mm_setzero_si128();
+	for (unsigned long i = 0; i < len; i += 64)
+	{
+		__m128i a = _mm_or_si128(_mm_load_si128((const __m128i *)(block + i)), _mm_load_si128((const __m128i *)(block + i + 16)));
+		__m128i b = _mm_or_si128(_mm_load_si128((const __m128i *)(block + i + 32)), _mm_load_si128((const __m128i *)(block + i + 48)));
+		any = _mm_or_si128(any, _mm_or_si128(a, b));
+	}
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) == 0xFFFF;
+#elif defined(HAVE_NEON)
+	uint8x16_t any = vdupq_n_u8(0);
+	for (unsigned long i = 0; i < len; i += 64)
+	{
+		uint8x16_t a = vorrq_u8(vld1q_u8(block + i), vld1q_u8(block + i + 16));
+		uint8x16_t b = vorrq_u8(vld1q_u8(block + i + 32), vld1q_u8(block + i + 48));
+		any = vorrq_u8(any, vorrq_u8(a, b));
+	}
+	return all_zero_neon(any);
+#else
+	unsigned char any = 0;
+	for (unsigned long i = 0; i < len; i++)
+	{
+		any |= block[i];
+	}
+	return any == 0;
+#endif
+}
+
+// Starts the write-behind task; if it cannot start, push_band writes the bands itself.
+void start_write_behind(FILE *output, struct band_queue *queue)
+{
+	queue->head = 0;
+	queue->count = 0;
+	queue->closed = 0;
+	queue->error = SUCCESS;
+	queue->ready = NULL;
+	queue->output = output;
+	init_signal(&queue->signal);
+	queue->task.func = write_behind_run;
+	queue->task.arg = queue;
+	queue->started = start_task(&queue->task) == SUCCESS;
+}
+
+// Queues a band, waiting while the queue is full. The band's memory must stay untouched until
+// finish_write_behind.
+void push_band(struct band_queue *queue, const char *data, unsigned long row_len, unsigned long stride, unsigned int rows)
+{
+	struct row_band band = { data, row_len, stride, rows };
+	if (!queue->started)
+	{
+		queue->error = queue->error == SUCCESS ? write_band(queue->output, &band) : queue->error;
+		return;
+	}
+	lock_signal(&queue->signal);
+	while (queue->count == WRITE_QUEUE_BANDS)
+	{
+		wait_signal(&queue->signal);
+	}
+	queue->bands[(queue->head + queue->count) % WRITE_QUEUE_BANDS] = band;
+	queue->count++;
+	notify_signal(&queue->signal);
+	unlock_signal(&queue->signal);
+}
+
+// Pushes band `band` of `job` once every earlier band is pushed; with several conversion threads
+// the band is flagged ready and pushed by whichever thread completes the run before it.
+void push_band_in_order(const struct convert_job *job, unsigned int band)
+{
+	struct band_queue *queue = job->queue;
+	unsigned long out_row = (unsigned long)job->width * job->bytes_pixel_out;
+	if (queue->ready == NULL)
+	{
+		unsigned int rows = job->height - band * job->band_rows > job->band_rows ? job->band_rows : job->height - band * job->band_rows;
+		push_band(queue, (const char *)job->out + band * job->band_rows * out_row, rows * out_row, rows * out_row, 1);
+		return;
+	}
+	lock_signal(&queue->signal);
+	queue->ready[band] = 1;
+	if (queue->pushing)
+	{
+		unlock_signal(&queue->signal);
+		return;
+	}
+	queue->pushing = 1;
+	while (queue->next_band < queue->ready_bands && queue->ready[queue->next_band])
+	{
+		unsigned int next = queue->next_band++;
+		unlock_signal(&queue->signal);
+		unsigned int rows = job->height - next * job->band_rows > job->band_rows ? job->band_rows : job->height - next * job->band_rows;
+		push_band(queue, (const char *)job->out + next * job->band_rows * out_row, rows * out_row, rows * out_row, 1);
+		lock_signal(&queue->signal);
+	}
+	queue->pushing = 0;
+	unlock_signal(&queue->signal);
+}
+
+// Waits until every queued band is written.
+int finish_write_behind(struct band_queue *queue)
+{
+	if (queue->started)
+	{
+		lock_signal(&queue->signal);
+		queue->closed = 1;
+		notify_signal(&queue->signal);
+		unlock_signal(&queue->signal);
+		join_task(&queue->task);
+	}
+	destroy_signal(&queue->signal);
+	return queue->error;
+}
+
+void *write_behind_run(void *arg)
+{
+	struct band_queue *queue = arg;
+	lock_signal(&queue->signal);
+	for (;;)
+	{
+		while (queue->count == 0 && !queue->closed)
+		{
+			wait_signal(&queue->signal);
+		}
+		if (queue->count == 0)
+		{
+			break;
+		}
+		struct row_band band = queue->bands[queue->head];
+		queue->head = (queue->head + 1) % WRITE_QUEUE_BANDS;
+		queue->count--;
+		notify_signal(&queue->signal);
+		unlock_signal(&queue->signal);
+		int error_write = queue->error == SUCCESS ? write_band(queue->output, &band) : queue->error;
+		lock_signal(&queue->signal);
+		queue->error = error_write;
+	}
+	unlock_signal(&queue->signal);
+	return NULL;
+}
+
+int write_band(FILE *output, const struct row_band *band)
+{
+	for (unsigned int i = 0; i < band->rows; i++)
+	{
+		if (fwrite(band->data + i * band->stride, sizeof(char), band->row_len, output) != band->row_len)
+		{
+			fprintf(stderr, "Error write in output file.\n");
+			return ERROR_UNKNOWN;
+		}
+	}
+	return SUCCESS;
+}
+
+// Creates (or recreates) the POSIX shared memory object `name` for a ring of rows of `row_bytes`
+// bytes and publishes its geometry.
+int open_ring(const char *name, unsigned int width, unsigned int height, int depth, int maxval, unsigned long row_bytes, struct row_ring *ring)
+{
+#if defined(_WIN32)
+	(void)width;
+	(void)height;
+	(void)depth;
+	(void)maxval;
+	(void)row_bytes;
+	(void)ring;
+	fprintf(stderr, "Shared memory rings are not supported on this platform, \"%s\" is not created.\n", name);
+	return ERROR_UNSUPPORTED;
+#else
+	unsigned long data_offset = (sizeof(struct ring_header) + 63) / 64 * 64;
+	ring->size = data_offset + RING_SLOTS * row_bytes;
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+	{
+		ERROR_MESSAGE_CANNOT_OPEN_FILE(name, "shm", ERROR_CANNOT_OPEN_FILE)
+	}
+	void *mapped = MAP_FAILED;
+	if (ftruncate(fd, (off_t)ring->size) == 0)
+	{
+		mapped = mmap(NULL, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	if (mapped == MAP_FAILED)
+	{
+		fprintf(stderr, "Cannot map shared memory \"%s\": %s.\n", name, strerror(errno));
+		close(fd);
+		return ERROR_CANNOT_OPEN_FILE;
+	}
+	close(fd);
+
+	ring->header = mapped;
+	ring->slots = (unsigned char *)mapped + data_offset;
+	ring->row_bytes = row_bytes;
+	ring->failed = 0;
+	memcpy(ring->header->magic, RING_MAGIC, sizeof(RING_MAGIC));
+	ring->header->width = width;
+	ring->header->height = height;
+	ring->header->depth = (unsigned int)depth;
+	ring->header->maxval = (unsigned int)maxval;
+	ring->header->row_bytes = row_bytes;
+	ring->header->data_offset = data_offset;
+	ring->header->slots = RING_SLOTS;
+	atomic_init(&ring->header->consumed, 0);
+	for (int s = 0; s < RING_SLOTS; s++)
+	{
+		atomic_init(&ring->header->sequence[s], 0);
+	}
+	atomic_store_explicit(&ring->header->state, RING_STREAMING, memory_order_release);
+	return SUCCESS;
+#endif
+}
+
+// Slot for `row`, once the consumer has read the row that used it before. The wait yields at
+// first and then sleeps a millisecond at a time; when the consumer has not read a row for
+// RING_STALL_SECONDS the ring is marked RING_FAILED and NULL is returned.
+unsigned char *ring_slot(struct row_ring *ring, unsigned int row)
+{
+	if (ring->failed)
+	{
+		return NULL;
+	}
+#if !defined(_WIN32)
+	unsigned long long consumed = atomic_load_explicit(&ring->header->consumed, memory_order_acquire);
+	struct timespec last = { 0, 0 };
+	for (int spins = 0; row >= consumed + RING_SLOTS; spins++)
+	{
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (spins == 0)
+		{
+			last = now;
+		}
+		else if ((now.tv_sec - last.tv_sec) * 1000 + (now.tv_nsec - last.tv_nsec) / 1000000 >= RING_STALL_SECONDS * 1000L)
+		{
+			fprintf(stderr, "Ring consumer has not read a row for %d seconds, giving up.\n", RING_STALL_SECONDS);
+			atomic_store_explicit(&ring->header->state, RING_FAILED, memory_order_release);
+			ring->failed = 1;
+			return NULL;
+		}
+		if (spins < 64)
+		{
+			sched_yield();
+		}
+		else
+		{
+			struct timespec pause = { 0, 1000000 };
+			nanosleep(&pause, NULL);
+		}
+		unsigned long long seen = atomic_load_explicit(&ring->header->consumed, memory_order_acquire);
+		if (seen != consumed)
+		{
+			consumed = seen;
+			last = now;
+		}
+	}
+#endif
+	return ring->slots + (unsigned long)(row % RING_SLOTS) * ring->row_bytes;
+}
+
+void ring_publish(struct row_ring *ring, unsigned int row)
+{
+#if defined(_WIN32)
+	(void)ring;
+	(void)row;
+#else
+	atomic_store_explicit(&ring->header->sequence[row % RING_SLOTS], (unsigned long long)row + 1, memory_order_release);
+#endif
+}
+
+// Publishes `rows` finished rows of ring->row_bytes bytes, `stride` bytes apart.
+int ring_put_rows(struct row_ring *ring, const char *data, unsigned long stride, unsigned int rows)
+{
+	for (unsigned int i = 0; i < rows; i++)
+	{
+		unsigned char *slot = ring_slot(ring, i);
+		if (slot == NULL)
+		{
+			return ERROR_UNKNOWN;
+		}
+		memcpy(slot, data + i * stride, ring->row_bytes);
+		ring_publish(ring, i);
+	}
+	return SUCCESS;
+}
+
+// Marks the stream done (or failed) and unmaps the ring. The shared memory object is left for
+// the consumer to unlink.
+int close_ring(struct row_ring *ring, int failed)
+{
+#if defined(_WIN32)
+	(void)ring;
+	(void)failed;
+	return ERROR_UNSUPPORTED;
+#else
+	atomic_store_explicit(&ring->header->state, failed || ring->failed ? RING_FAILED : RING_DONE, memory_order_release);
+	return munmap(ring->header, ring->size) == 0 ? SUCCESS : ERROR_UNKNOWN;
+#endif
+}
+
+// ---- TAR ----
+// Entry name for `input`: its relative path with the extension replaced by `extension`. Leading
+// separators, drive letters and "." components are dropped and ".." removes the component before
+// it (or nothing at the start), so entries cannot point outside the directory they are extracted
+// to while same-named files from different directories stay apart.
+int tar_entry_name(const char *input, const char *extension, char name[TAR_NAME_SIZE])
+{
+	size_t len = 0;
+	const char *c = input;
+	if (((c[0] | 0x20) >= 'a' && (c[0] | 0x20) <= 'z') && c[1] == ':')
+	{
+		c += 2;
+	}
+	while (*c != '\0')
+	{
+		size_t part = strcspn(c, "/\\");
+		if (part == 2 && c[0] == '.' && c[1] == '.')
+		{
+			while (len > 0 && name[--len] != '/')
+			{
+			}
+		}
+		else if (part > 0 && !(part == 1 && c[0] == '.'))
+		{
+			if (len + (len > 0) + part >= TAR_NAME_SIZE)
+			{
+				fprintf(stderr, "File name \"%s\" is too long for a tar entry.\n", input);
+				return ERROR_PARAMETER_INVALID;
+			}
+			if (len > 0)
+			{
+				name[len++] = '/';
+			}
+			memcpy(name + len, c, part);
+			len += part;
+		}
+		c += part + (c[part] != '\0');
+	}
+	name[len] = '\0';
+	if (len == 0)
+	{
+		fprintf(stderr, "File name \"%s\" cannot be used for a tar entry.\n", input);
+		return ERROR_PARAMETER_INVALID;
+	}
+	const char *base = strrchr(name, '/');
+	base = base != NULL ? base + 1 : name;
+	const char *dot = strrchr(base, '.');
+	size_t stem = dot != NULL && dot != base ? (size_t)(dot - name) : len;
+	if (stem + strlen(extension) >= TAR_NAME_SIZE)
+	{
+		fprintf(stderr, "File name \"%s\" is too long for a tar entry.\n", input);
+		return ERROR_PARAMETER_INVALID;
+	}
+	strcpy(name + stem, extension);
+	if (tar_name_split(name) == (size_t)-1)
+	{
+		fprintf(stderr, "File name \"%s\" is too long for a tar entry.\n", input);
+		return ERROR_PARAMETER_INVALID;
+	}
+	return SUCCESS;
+}
+
+// Length of the ustar prefix field for `name`: 0 when the name fits the 100-byte name field,
+// otherwise the last '/' that leaves at most 155 bytes before it and 100 after it; (size_t)-1
+// when there is no such split.
+size_t tar_name_split(const char *name)
+{
+	size_t len = strlen(name);
+	if (len <= 100)
+	{
+		return 0;
+	}
+	for (size_t i = len - 1; i > 0; i--)
+	{
+		if (name[i] == '/' && i <= 155 && len - i - 1 <= 100 && len - i - 1 > 0)
+		{
+			return i;
+		}
+		if (len - i - 1 > 100)
+		{
+			break;
+		}
+	}
+	return (size_t)-1;
+}
+
+// POSIX ustar header of a regular file. Sizes that do not fit 11 octal digits use the base-256
+// form understood by GNU and BSD tar.
+int write_tar_header(FILE *archive, const char *name, unsigned long long size)
+{
+	unsigned char block[TAR_BLOCK] = { 0 };
+	size_t prefix = tar_name_split(name);
+	if (prefix == (size_t)-1)
+	{
+		fprintf(stderr, "File name \"%s\" is too long for a tar entry.\n", name);
+		return ERROR_PARAMETER_INVALID;
+	}
+	if (prefix > 0)
+	{
+		memcpy(block + 345, name, prefix);
+		name += prefix + 1;
+	}
+	memcpy(block, name, strlen(name));
+	memcpy(block + 100, "0000644", 8);
+	memcpy(block + 108, "0000000", 8);
+	memcpy(block + 116, "0000000", 8);
+	if (size < 077777777777ULL)
+	{
+		snprintf((char *)block + 124, 12, "%011llo", size);
+	}
+	else
+	{
+		block[124] = 0x80;
+		for (int i = 0; i < 8; i++)
+		{
+			block[135 - i] = (unsigned char)(size >> (8 * i));
+		}
+	}
+	snprintf((char *)block + 136, 12, "%011llo", (unsigned long long)time(NULL));
+	block[156] = '0';
+	memcpy(block + 257, "ustar", 6);
+	memcpy(block + 263, "00", 2);
+	unsigned int checksum = 8 * ' ';
+	for (int i = 0; i < TAR_BLOCK; i++)
+	{
+		checksum += i >= 148 && i < 156 ? 0 : block[i];
+	}
+	snprintf((char *)block + 148, 8, "%06o", checksum);
+	block[155] = ' ';
+	if (fwrite(block, sizeof(char), TAR_BLOCK, archive) != TAR_BLOCK)
+	{
+		fprintf(stderr, "Error write in output file.\n");
+		return ERROR_UNKNOWN;
+	}
+	return SUCCESS;
+}
+
+// Zero bytes that complete the last block of an entry of `size` bytes.
+int write_tar_padding(FILE *archive, unsigned long long size)
+{
+	char block[TAR_BLOCK] = { 0 };
+	size_t padding = (size_t)((TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK);
+	return fwrite(block, sizeof(char), padding, archive) == padding ? SUCCESS : ERROR_UNKNOWN;
+}
+
+int open_tar_reader(const char *path, struct tar_reader *reader)
+{
+#if defined(_WIN32)
+	(void)reader;
+	fprintf(stderr, "Reading \"%s\" as a tar archive is not supported on this platform.\n", path);
+	return ERROR_UNSUPPORTED;
+#else
+	reader->stream = NULL;
+	reader->map = NULL;
+	reader->map_size = 0;
+	reader->offset = 0;
+	reader->buffer = NULL;
+	reader->name[0] = '\0';
+	if (strcmp(path, "-") == 0)
+	{
+		reader->stream = stdin;
+		return SUCCESS;
+	}
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0)
+	{
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+		ERROR_MESSAGE_CANNOT_OPEN_FILE(path, "rb", ERROR_CANNOT_OPEN_FILE)
+	}
+	reader->map_size = (unsigned long long)st.st_size;
+	if (reader->map_size > 0)
+	{
+		void *mapped = mmap(NULL, reader->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mapped == MAP_FAILED)
+		{
+			fprintf(stderr, "Cannot map \"%s\": %s.\n", path, strerror(errno));
+			close(fd);
+			return ERROR_CANNOT_OPEN_FILE;
+		}
+		reader->map = mapped;
+	}
+	close(fd);
+	return SUCCESS;
+#endif
+}
+
+// Steps to the next member: its name goes to reader->name and *data points at its bytes until the
+// next call (NULL at the end of the archive). Links, directories and extended headers come
+// back with an empty name, so the caller skips them.
+int next_tar_member(struct tar_reader *reader, const char **data, unsigned long long *size)
+{
+	unsigned char block[TAR_BLOCK];
+	const unsigned char *header;
+	free(reader->buffer);
+	reader->buffer = NULL;
+	*data = NULL;
+	if (reader->stream != NULL)
+	{
+		size_t got = fread(block, sizeof(char), TAR_BLOCK, reader->stream);
+		if (got == 0 && feof(reader->stream))
+		{
+			return SUCCESS;
+		}
+		if (got != TAR_BLOCK)
+		{
+			fprintf(stderr, "Input tar archive is truncated.\n");
+			return ERROR_DATA_INVALID;
+		}
+		header = block;
+	}
+	else
+	{
+		if (reader->offset + TAR_BLOCK > reader->map_size)
+		{
+			return SUCCESS;
+		}
+		header = reader->map + reader->offset;
+		reader->offset += TAR_BLOCK;
+	}
+	int empty = 1;
+	for (int i = 0; i < TAR_BLOCK && empty; i++)
+	{
+		empty = header[i] == 0;
+	}
+	if (empty)
+	{
+		return SUCCESS;
+	}
+
+	unsigned long long length = 0;
+	if (header[124] & 0x80)
+	{
+		for (int i = 128; i < 136; i++)
+		{
+			length = length << 8 | header[i];
+		}
+	}
+	else
+	{
+		for (int i = 124; i < 136 && header[i] >= '0' && header[i] <= '7'; i++)
+		{
+			length = length * 8 + (header[i] - '0');
+		}
+	}
+	char type = (char)header[156];
+	if (type == '0' || type == '\0')
+	{
+		size_t prefix = memcmp(header + 257, "ustar", 5) == 0 ? strnlen((const char *)header + 345, 155) : 0;
+		size_t name = strnlen((const char *)header, 100);
+		memcpy(reader->name, header + 345, prefix);
+		reader->name[prefix] = '/';
+		memcpy(reader->name + (prefix > 0 ? prefix + 1 : 0), header, name);
+		reader->name[(prefix > 0 ? prefix + 1 : 0) + name] = '\0';
+	}
+	else
+	{
+		reader->name[0] = '\0';
+	}
+
+	if (reader->stream != NULL ? length > 0xFFFFFFFFULL - TAR_BLOCK : length > reader->map_size - reader->offset)
+	{
+		if (reader->stream != NULL)
+		{
+			fprintf(stderr, "Tar member \"%s\" is too large to read from a stream.\n", reader->name);
+		}
+		else
+		{
+			fprintf(stderr, "Input tar archive is truncated.\n");
+		}
+		return ERROR_DATA_INVALID;
+	}
+	unsigned long long padded = (length + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+	if (reader->stream != NULL)
+	{
+		if (padded > 0 && allocate_vector((unsigned int)padded, &reader->buffer) != SUCCESS)
+		{
+			fprintf(stderr, "Error memory allocation failed for tar member \"%s\".\n", reader->name);
+			return ERROR_OUT_OF_MEMORY;
+		}
+		if (fread(reader->buffer, sizeof(char), (size_t)padded, reader->stream) != padded)
+		{
+			fprintf(stderr, "Input tar archive is truncated.\n");
+			return ERROR_DATA_INVALID;
+		}
+		*data = reader->buffer != NULL ? reader->buffer : "";
+	}
+	else
+	{
+		*data = (const char *)reader->map + reader->offset;
+		reader->offset += padded;
+	}
+	*size = length;
+	return SUCCESS;
+}
+
+void close_tar_reader(struct tar_reader *reader)
+{
+	free(reader->buffer);
+#if !defined(_WIN32)
+	if (reader->map != NULL)
+	{
+		munmap((void *)reader->map, reader->map_size);
+	}
+#endif
+}
+
+int has_png_extension(const char *name)
+{
+	size_t len = strlen(name);
+	if (len < 4)
+	{
+		return 0;
+	}
+	const char *ext = name + len - 4;
+	return ext[0] == '.' && (ext[1] | 0x20) == 'p' && (ext[2] | 0x20) == 'n' && (ext[3] | 0x20) == 'g';
+}
+
+// Creates the directories of `path` past its first `from` bytes (an existing output directory).
+int make_parent_directories(char *path, size_t from)
+{
+#if defined(_WIN32)
+	(void)path;
+	(void)from;
+	return ERROR_UNSUPPORTED;
+#else
+	for (char *c = path + from; *c != '\0'; c++)
+	{
+		if (*c != '/' || c == path)
+		{
+			continue;
+		}
+		*c = '\0';
+		int made = mkdir(path, 0777) == 0 || errno == EEXIST;
+		*c = '/';
+		if (!made)
+		{
+			fprintf(stderr, "Cannot create directory for \"%s\": %s.\n", path, strerror(errno));
+			return ERROR_CANNOT_OPEN_FILE;
+		}
+	}
+	return SUCCESS;
+#endif
+}
+
+// ---- TENSOR ----
+// NPY 1.0 header for an 8-bit image of `channels` channels, padded to MAX_HEADER bytes.
+int format_npy_header(char header[MAX_HEADER], unsigned int width, unsigned int height, int channels, const struct tensor_format *tensor)
+{
+	const unsigned short one = 1;
+	char descr[4] = { '|', 'u', '1', '\0' };
+	if (tensor->float32)
+	{
+		memcpy(descr, *(const unsigned char *)&one ? "<f4" : ">f4", 4);
+	}
+	char shape[64];
+	if (tensor->chw)
+	{
+		snprintf(shape, sizeof(shape), "(%d, %u, %u)", channels, height, width);
+	}
+	else
+	{
+		snprintf(shape, sizeof(shape), "(%u, %u, %d)", height, width, channels);
+	}
+	int dict_len = MAX_HEADER - 10;
+	memcpy(header, "\x93NUMPY\x01\x00", 8);
+	header[8] = (char)(dict_len & 0xFF);
+	header[9] = (char)(dict_len >> 8);
+	char dict[MAX_HEADER];
+	int len = snprintf(dict, sizeof(dict), "{'descr': '%s', 'fortran_order': False, 'shape': %s, }", descr, shape);
+	memset(header + 10, ' ', dict_len);
+	memcpy(header + 10, dict, len);
+	header[MAX_HEADER - 1] = '\n';
+	return MAX_HEADER;
+}
+
+// Stores converted row `y` into the tensor at `out`: as is (hwc) or split into channel planes
+// (chw, through `plane`), as bytes or normalized floats.
+void store_tensor_row(const unsigned char *row, unsigned char *out, unsigned int y, unsigned int width, unsigned int height, int channels, const struct tensor_format *tensor, unsigned char *plane)
+{
+	unsigned long element = tensor->float32 ? sizeof(float) : 1;
+	if (!tensor->chw)
+	{
+		unsigned char *dst = out + (unsigned long)y * width * channels * element;
+		if (tensor->float32)
+		{
+			bytes_to_floats(row, (float *)dst, (unsigned long)width * channels, channels, tensor->scale, tensor->bias);
+		}
+		else
+		{
+			memcpy(dst, row, (size_t)width * channels);
+		}
+		return;
+	}
+	for (int c = 0; c < channels; c++)
+	{
+		unsigned char *dst = out + ((unsigned long)c * height + y) * width * element;
+		const unsigned char *samples = row;
+		if (channels > 1)
+		{
+			unsigned char *split = tensor->float32 ? plane : dst;
+			for (unsigned int j = 0; j < width; j++)
+			{
+				split[j] = row[j * channels + c];
+			}
+			samples = split;
+		}
+		if (tensor->float32)
+		{
+			bytes_to_floats(samples, (float *)dst, width, 1, tensor->scale + c, tensor->bias + c);
+		}
+		else if (channels == 1)
+		{
+			memcpy(dst, samples, width);
+		}
+	}
+}
+
+// out[i] = in[i] * scale[i % period] + bias[i % period], period 1 to 4.
+void bytes_to_floats(const unsigned char *in, float *out, unsigned long n, int period, const float *scale, const float *bias)
+{
+	unsigned long i = 0;
+#if defined(HAVE_SSE2) || defined(HAVE_NEON)
+	// a block of 16 samples holds whole pixels unless period is 3, then 3 blocks do
+	int vectors = period == 3 ? 12 : 4;
+	float scales[12][4];
+	float biases[12][4];
+	for (int v = 0; v < vectors; v++)
+	{
+		for (int l = 0; l < 4; l++)
+		{
+			scales[v][l] = scale[(v * 4 + l) % period];
+			biases[v][l] = bias[(v * 4 + l) % period];
+		}
+	}
+	unsigned long block = (unsigned long)vectors * 4;
+	for (; i + block <= n; i += block)
+	{
+		for (int v = 0; v < vectors; v += 4)
+		{
+			const unsigned char *src = in + i + v * 4;
+			float *dst = out + i + v * 4;
+#if defined(HAVE_SSE2)
+			__m128i zero = _mm_setzero_si128();
+			__m128i bytes = _mm_loadu_si128((const __m128i *)src);
+			__m128i lo = _mm_unpacklo_epi8(bytes, zero);
+			__m128i hi = _mm_unpackhi_epi8(bytes, zero);
+			__m128i words[4] = { _mm_unpacklo_epi16(lo, zero), _mm_unpackhi_epi16(lo, zero), _mm_unpacklo_epi16(hi, zero), _mm_unpackhi_epi16(hi, zero) };
+			for (int k = 0; k < 4; k++)
+			{
+				__m128 x = _mm_cvtepi32_ps(words[k]);
+				__m128 y = _mm_add_ps(_mm_mul_ps(x, _mm_loadu_ps(scales[v + k])), _mm_loadu_ps(biases[v + k]));
+				_mm_storeu_ps(dst + 4 * k, y);
+			}
+#else
+			uint8x16_t bytes = vld1q_u8(src);
+			uint16x8_t lo = vmovl_u8(vget_low_u8(bytes));
+			uint16x8_t hi = vmovl_u8(vget_high_u8(bytes));
+			uint32x4_t words[4] = { vmovl_u16(vget_low_u16(lo)), vmovl_u16(vget_high_u16(lo)), vmovl_u16(vget_low_u16(hi)), vmovl_u16(vget_high_u16(hi)) };
+			for (int k = 0; k < 4; k++)
+			{
+				float32x4_t x = vcvtq_f32_u32(words[k]);
+				vst1q_f32(dst + 4 * k, vmlaq_f32(vld1q_f32(biases[v + k]), x, vld1q_f32(scales[v + k])));
+			}
+#endif
+		}
+	}
+#endif
+	for (; i < n; i++)
+	{
+		out[i] = in[i] * scale[i % period] + bias[i % period];
+	}
+}
+
+// ---- AUTO GRAY ----
+// Entries past the palette size are black, so all 256 are checked.
+int is_gray_palette(const struct palette *palette)
+{
+	for (int v = 0; v < 256; v++)
+	{
+		if (palette->planes[0][v] != palette->planes[1][v] || palette->planes[1][v] != palette->planes[2][v])
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// R == G == B for every pixel of an RGB row. SSE2 compares 16 pixels (48 bytes) per step with the
+// same bytes shifted by one; only the R-G and G-B pairs have to match.
+int is_gray_row(const unsigned char *row, unsigned int width)
+{
+	unsigned int j = 0;
+#if defined(HAVE_SSE2)
+	int pair_mask[3] = { 0, 0, 0 };
+	for (int b = 0; b < 48; b++)
+	{
+		if (b % 3 != 2)
+		{
+			pair_mask[b / 16] |= 1 << (b % 16);
+		}
+	}
+	for (; j + 17 <= width; j += 16)
+	{
+		for (int n = 0; n < 3; n++)
+		{
+			const unsigned char *block = row + 3 * j + 16 * n;
+			__m128i equal = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)block), _mm_loadu_si128((const __m128i *)(block + 1)));
+			if ((_mm_movemask_epi8(equal) & pair_mask[n]) != pair_mask[n])
+			{
+				return 0;
+			}
+		}
+	}
+#endif
+	unsigned int difference = 0;
+	for (; j < width; j++)
+	{
+		difference |= (row[3 * j] ^ row[3 * j + 1]) | (row[3 * j + 1] ^ row[3 * j + 2]);
+	}
+	return difference == 0;
+}
+
+int is_gray_rows(unsigned int width, unsigned int height, unsigned long stride, const unsigned char *rgb)
 {
-	int return_code = SUCCESS;
-	struct chunk chunk;
-	do
+	for (unsigned int i = 0; i < height; i++)
 	{
-		CHECK_ERROR(SUCCESS, read_chunk(input, &chunk, crc_table), read_chunk_error_check)
-		if (chunk.type == IHDR)
+		if (!is_gray_row(rgb + i * stride, width))
 		{
-			fprintf(stderr, "More than one IHDR chunk found - error.\n");
-			return_code = ERROR_DATA_INVALID;
-			goto end_read;
+			return 0;
 		}
-		else if (chunk.type == PLTE)
+	}
+	return 1;
+}
+
+// Keeps the first sample of every pixel of RGB rows `stride` bytes apart as contiguous gray rows.
+// Every gray byte lands at or before its source, so `gray` may point into `rgb`.
+void pack_gray(unsigned int width, unsigned int height, unsigned long stride, const unsigned char *rgb, unsigned char *gray)
+{
+	for (unsigned int i = 0; i < height; i++)
+	{
+		for (unsigned int j = 0; j < width; j++)
 		{
-			if (!(*plte_go))
+			gray[(size_t)i * width + j] = rgb[i * stride + 3 * j];
+		}
+	}
+}
+
+// ---- CONVERSION ----
+// Picks the row converter for the image configuration once and prepares the table it reads:
+// images without tRNS are copied, tRNS keys are looked up or compared against precomputed
+// values and alpha is blended onto the background, so no converter branches on the color type.
+// With keep_alpha (PAM) nothing is blended: alpha is copied and tRNS becomes an alpha channel.
+row_kernel prepare_conversion(
+	char color_type,
+	struct chunk plte,
+	int go_trns,
+	struct chunk trns,
+	const unsigned char background[3],
+	int keep_alpha,
+	struct conversion *conversion)
+{
+	memcpy(conversion->background, background, 3);
+	switch (color_type)
+	{
+	case 0:
+		if (!go_trns)
+		{
+			return copy_gray;
+		}
+		make_gray_table(trns, background[0], &conversion->gray);
+		if (keep_alpha)
+		{
+			return expand_gray_key;
+		}
+		return conversion->gray.changed_count == 0 ? copy_gray : select_gray_kernel(&conversion->gray);
+	case 2:
+		if (!go_trns)
+		{
+			return copy_rgb;
+		}
+		make_color_keys(trns, &conversion->keys);
+		if (keep_alpha)
+		{
+			return expand_color_keys;
+		}
+		return conversion->keys.count == 0 ? copy_rgb : select_color_key_kernel(&conversion->keys);
+	case 3:
+		make_palette(plte, go_trns, trns, background, keep_alpha, &conversion->palette);
+		return keep_alpha && go_trns ? select_palette_rgba_kernel() : select_palette_kernel(&conversion->palette);
+	default:
+		if (keep_alpha)
+		{
+			return color_type == 4 ? copy_gray_alpha : copy_rgba;
+		}
+		return select_composite_kernel(color_type);
+	}
+}
+
+#define DEFINE_COPY_KERNEL(NAME, CHANNELS)                                                                            \
+	void NAME(const unsigned char *in, unsigned char *out, unsigned int width, const struct conversion *conversion)   \
+	{                                                                                                                 \
+		(void)conversion;                                                                                             \
+		memmove(out, in, (size_t)width * (CHANNELS));                                                                 \
+	}
+
+DEFINE_COPY_KERNEL(copy_gray, 1)
+
+DEFINE_COPY_KERNEL(copy_rgb, 3)
+
+DEFINE_COPY_KERNEL(copy_gray_alpha, 2)
+
+DEFINE_COPY_KERNEL(copy_rgba, 4)
+
+// ---- COMPOSITE ----
+// Alpha compositing of gray+alpha and RGBA rows onto the background. All kernels produce the
+// result of the reference formula
+//     out = (p * a + bg * (255 - a) + 127) / 255
+// bit for bit: fully opaque pixels stay p, fully transparent ones become bg. The vector kernels
+// replace the division with (t + 1 + (t >> 8)) >> 8, which equals t / 255 for every t <= 255 * 255 + 127.
+row_kernel select_composite_kernel(char color_type)
+{
+#if defined(HAVE_X86_DISPATCH)
+	if (cpu_supports(CPU_AVX2))
+	{
+		return color_type == 4 ? composite_gray_alpha_avx2 : composite_rgba_avx2;
+	}
+#endif
+#if defined(HAVE_SSE2)
+	return color_type == 4 ? composite_gray_alpha_sse2 : composite_rgba_sse2;
+#elif defined(HAVE_NEON)
+	return color_type == 4 ? composite_gray_alpha_neon : composite_rgba_neon;
+#else
+	return color_type == 4 ? composite_gray_alpha : composite_rgba;
+#endif
+}
+
+// Scalar kernels are instantiated per channel count, so the per-pixel loop has constant bounds.
+#define DEFINE_COMPOSITE_KERNEL(NAME, CHANNELS)                                                                       \
+	void NAME(const unsigned char *in, unsigned char *out, unsigned int width, const struct conversion *conversion)   \
+	{                                                                                                                 \
+		for (unsigned int j = 0; j < width; j++)                                                                      \
+		{                                                                                                             \
+			unsigned int alpha = in[((CHANNELS) + 1) * j + (CHANNELS)];                                               \
+			for (int it = 0; it < (CHANNELS); it++)                                                                   \
+			{                                                                                                         \
+				unsigned int t = in[((CHANNELS) + 1) * j + it] * alpha + conversion->background[it] * (255 - alpha);  \
+				out[(CHANNELS) * j + it] = (unsigned char)((t + 127) / 255);                                          \
+			}                                                                                                         \
+		}                                                                                                             \
+	}
+
+DEFINE_COMPOSITE_KERNEL(composite_gray_alpha, 1)
+
+DEFINE_COMPOSITE_KERNEL(composite_rgba, 3)
+
+// Images without a single translucent pixel only drop the alpha sample.
+#define DEFINE_STRIP_ALPHA_KERNEL(NAME, CHANNELS)                                                                     \
+	void NAME(const unsigned char *in, unsigned char *out, unsigned int width, const struct conversion *conversion)   \
+	{                                                                                                                 \
+		(void)conversion;                                                                                             \
+		for (unsigned int j = 0; j < width; j++)                                                                      \
+		{                                                                                                             \
+			for (int it = 0; it < (CHANNELS); it++)                                                                   \
+			{                                                                                                         \
+				out[(CHANNELS) * j + it] = in[((CHANNELS) + 1) * j + it];                                             \
+			}                                                                                                         \
+		}                                                                                                             \
+	}
+
+DEFINE_STRIP_ALPHA_KERNEL(strip_gray_alpha, 1)
+
+DEFINE_STRIP_ALPHA_KERNEL(strip_rgba, 3)
+
+row_kernel select_strip_alpha_kernel(char color_type)
+{
+#if defined(HAVE_X86_DISPATCH)
+	if (color_type == 6 && cpu_supports(CPU_SSSE3))
+	{
+		return strip_rgba_ssse3;
+	}
+#endif
+#if defined(HAVE_SSE2)
+	if (color_type == 4)
+	{
+		return strip_gray_alpha_sse2;
+	}
+#endif
+	return color_type == 4 ? strip_gray_alpha : strip_rgba;
+}
+
+// Whether every alpha sample (the last of each pixel) of the unfiltered rows is 255. The scan
+// stops at the first translucent block, which for images with transparency is usually early.
+int is_opaque_image(unsigned int width, unsigned int height, int bytes_pixel, const char *png_data)
+{
+	unsigned long delm = width * bytes_pixel + 1;
+	for (unsigned int i = 0; i < height; i++)
+	{
+		const unsigned char *row = (const unsigned char *)&ARR(png_data, i, 1, delm);
+		unsigned long length = width * bytes_pixel;
+		unsigned long k = 0;
+#if defined(HAVE_SSE2)
+		const int alpha_bits = bytes_pixel == 2 ? 0xAAAA : 0x8888;
+		const __m128i all_ones = _mm_set1_epi8((char)0xFF);
+		for (; k + 16 <= length; k += 16)
+		{
+			__m128i opaque = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(row + k)), all_ones);
+			if ((_mm_movemask_epi8(opaque) & alpha_bits) != alpha_bits)
 			{
-				(*plte) = chunk;
-				*plte_go = 1;
+				return 0;
 			}
-			else
+		}
+#endif
+		unsigned int alpha = 255;
+		for (k += bytes_pixel - 1; k < length; k += bytes_pixel)
+		{
+			alpha &= row[k];
+		}
+		if (alpha != 255)
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+#if defined(HAVE_SSE2)
+void composite_gray_alpha_sse2(const unsigned char *in, unsigned char *out, unsigned int width, const struct conversion *conversion)
+{
+	const unsigned char *background = conversion->background;
+	const __m128i low_mask = _mm_set1_epi16(0x00FF);
+	const __m128i max = _mm_set1_epi16(255);
+	const __m128i bias = _mm_set1_epi16(127);
+	const __m128i one = _mm_set1_epi16(1);
+	const __m128i bg = _mm_set1_epi16(background[0]);
+	const __m128i all_ones = _mm_set1_epi8((char)0xFF);
+	const __m128i zero = _mm_setzero_si128();
+	unsigned int j = 0;
+	for (; j + 8 <= width; j += 8)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + 2 * j));
+		int opaque = _mm_movemask_epi8(_mm_cmpeq_epi8(v, all_ones)) & 0xAAAA;
+		int clear = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) & 0xAAAA;
+		__m128i t;
+		if (opaque == 0xAAAA)
+		{
+			t = _mm_and_si128(v, low_mask);
+		}
+		else if (clear == 0xAAAA)
+		{
+			t = bg;
+		}
+		else
+		{
+			__m128i alpha = _mm_srli_epi16(v, 8);
+			t = _mm_add_epi16(_mm_mullo_epi16(_mm_and_si128(v, low_mask), alpha), _mm_mullo_epi16(bg, _mm_sub_epi16(max, alpha)));
+			t = _mm_add_epi16(t, bias);
+			t = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(t, one), _mm_srli_epi16(t, 8)), 8);
+		}
+		_mm_storel_epi64((__m128i *)(out + j), _mm_packus_epi16(t, t));
+	}
+	composite_gray_alpha(in + 2 * j, out + j, width - j, conversion);
+}
+
+void strip_gray_alpha_sse2(const unsigned char *in, unsigned char *out, unsigned int width, const struct conversion *conversion)
+{
+	const __m128i low_mask = _mm_set1_epi16(0x00FF);
+	unsigned int j = 0;
+	for (; j + 16 <= width; j += 16)
+	{
+		__m128i low = _mm_and_si128(_mm_loadu_si128((const __m128i *)(in + 2 * j)), low_mask);
+		__m128i high = _mm_and_si128(_mm_loadu_si128((const __m128i *)(in + 2 * j + 16)), low_mask);
+		_mm_storeu_si128((__m128i *)(out + j), _mm_packus_epi16(low, high));
+	}
+	strip_gray_alpha(in + 2 * j, out + j, width - j, conversion);
+}
+
+// Blends four RGBA pixels per step and stores them as overlapping 4-byte RGBx words, so the
+// loop keeps one pixel in reserve for the byte written past the last pixel of a step. Steps that
+// are fully opaque or fully transparent skip the blend.
+void composite_rgba_sse2(const unsigned char *in, unsigned char *out, unsigned int width, const struct conversion *conversion)
+{
+	const unsigned char *background = conversion->background;
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i max = _mm_set1_epi16(255);
+	const __m128i bias = _mm_set1_epi16(127);
+	const __m128i one = _mm_set1_epi16(1);
+	const __m128i bg = _mm_setr_epi16(background[0], background[1], background[2], 0, background[0], background[1], background[2], 0);
+	const __m128i bg_rgbx = _mm_packus_epi16(bg, bg);
+	const __m128i all_ones = _mm_set1_epi8((char)0xFF);
+	unsigned int j = 0;
+	for (; j + 4 < width; j += 4)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + 4 * j));
+		int opaque = _mm_movemask_epi8(_mm_cmpeq_epi8(v, all_ones)) & 0x8888;
+		int clear = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) & 0x8888;
+		unsigned char rgbx[16];
+		if (opaque == 0x8888)
+		{
+			_mm_storeu_si128((__m128i *)rgbx, v);
+		}
+		else if (clear == 0x8888)
+		{
+			_mm_storeu_si128((__m128i *)rgbx, bg_rgbx);
+		}
+		else
+		{
+			__m128i halves[2] = { _mm_unpacklo_epi8(v, zero), _mm_unpackhi_epi8(v, zero) };
+			for (int h = 0; h < 2; h++)
 			{
-				fprintf(stderr, "More than one PLTE chunk found - error.\n");
-				return_code = ERROR_DATA_INVALID;
-				goto end_read;
+				__m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(halves[h], 0xFF), 0xFF);
+				__m128i t = _mm_add_epi16(_mm_mullo_epi16(halves[h], alpha), _mm_mullo_epi16(bg, _mm_sub_epi16(max, alpha)));
+				t = _mm_add_epi16(t, bias);
+				halves[h] = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(t, one), _mm_srli_epi16(t, 8)), 8);
 			}
-			continue;
+			_mm_storeu_si128((__m128i *)rgbx, _mm_packus_epi16(halves[0], halves[1]));
 		}
-		else if (chunk.type == IDAT)
+		for (int k = 0; k < 4; k++)
 		{
-			char *t;
-			unsigned long new_i_data_len = (*i_data_len) + chunk.length;
-			union_two((*i_data_len), (*i_data), chunk.length, chunk.data, &t);
-			free((*i_data));
-			(*i_data_len) = new_i_data_len;
-			(*i_data) = t;
+			memcpy(out + 3 * (j + k), rgbx + 4 * k, 4);
+		}
+	}
+	composite_rgba(in + 4 * j, out + 3 * j, width - j, conversion);
+}
+#endif
+
+#if defined(HAVE_X86_DISPATCH)
+int cpu_supports(enum cpu_feature feature)
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	int max_leaf = info[0];
+	__cpuid(info, 1);
+	if (feature == CPU_SSSE3)
+	{
+		return (info[2] & (1 << 9)) != 0;
+	}
+	if (max_leaf < 7 || !(info[2] & (1 << 27)))
+	{
+		return 0;
+	}
+	unsigned long long os_state = _xgetbv(0);
+	__cpuidex(info, 7, 0);
+	if (feature == CPU_AVX2)
+	{
+		return (os_state & 0x06) == 0x06 && (info[1] & (1 << 5)) != 0;
+	}
+	return (os_state & 0xE6) == 0xE6 && (info[1] & (1 << 16)) != 0 && (info[1] & (1 << 30)) != 0 && (info[2] & (1 << 1)) != 0;
+#else
+	switch (feature)
+	{
+	case CPU_SSSE3:
+		return __builtin_cpu_supports("ssse3");
+	case CPU_AVX2:
+		return __builtin_cpu_supports("avx2");
+	default:
+		return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vbmi");
+	}
+#endif
+}
+
+TARGET_AVX2 void composite_gray_alpha_avx2(const unsigned char *in, unsigned char *out, unsigned int width, const struct conversion *conversion)
+{
+	const unsigned char *background = conversion->background;
+	const __m256i low_mask = _mm256_set1_epi16(0x00FF);
+	const __m256i max = _mm256_set1_epi16(255);
+	const __m256i bias = _mm256_set1_epi16(127);
+	const __m256i one = _mm256_set1_epi16(1);
+	const __m256i bg = _mm256_set1_epi16(background[0]);
+	const __m256i all_ones = _mm256_set1_epi8((char)0xFF);
+	const __m256i zero = _mm256_setzero_si256();
+	unsigned int j = 0;
+	for (; j + 16 <= width; j += 16)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *)(in + 2 * j));
+		unsigned int opaque = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, all_ones)) & 0xAAAAAAAAu;
+		unsigned int clear = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero)) & 0xAAAAAAAAu;
+		__m256i t;
+		if (opaque == 0xAAAAAAAAu)
+		{
+			t = _mm256_and_si256(v, low_mask);
+		}
+		else if (clear == 0xAAAAAAAAu)
+		{
+			t = bg;
 		}
 		else
 		{
-			int check_inp = 0;
-			for (int i = 0; i < num_in_blocks; i++)
+			__m256i alpha = _mm256_srli_epi16(v, 8);
+			t = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_and_si256(v, low_mask), alpha), _mm256_mullo_epi16(bg, _mm256_sub_epi16(max, alpha)));
+			t = _mm256_add_epi16(t, bias);
+			t = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(t, one), _mm256_srli_epi16(t, 8)), 8);
+		}
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(t, t), 0x08);
+		_mm_storeu_si128((__m128i *)(out + j), _mm256_castsi256_si128(packed));
+	}
+	composite_gray_alpha(in + 2 * j, out + j, width - j, conversion);
+}
+
+// Eight pixels per step; every 128-bit lane is compacted to 12 RGB bytes and stored with 16-byte
+// stores, so the loop keeps two pixels in reserve for the 4 bytes written past the last pixel.
+// Steps that are fully opaque or fully transparent skip the blend.
+TARGET_AVX2 void composite_rgba_avx2(const unsigned char *in, unsigned char *out, unsigned int width, const struct conversion *conversion)
+{
+	const unsigned char *background = conversion->background;
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i max = _mm256_set1_epi16(255);
+	const __m256i bias = _mm256_set1_epi16(127);
+	const __m256i one = _mm256_set1_epi16(1);
+	const __m256i bg = _mm256_setr_epi16(
+		background[0], background[1], background[2], 0, background[0], background[1], background[2], 0,
+		background[0], background[1], background[2], 0, background[0], background[1], background[2], 0);
+	const __m256i compact = _mm256_setr_epi8(
+		0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1, 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	const __m256i bg_rgb = _mm256_shuffle_epi8(_mm256_packus_epi16(bg, bg), compact);
+	const __m256i all_ones = _mm256_set1_epi8((char)0xFF);
+	unsigned int j = 0;
+	for (; j + 10 <= width; j += 8)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *)(in + 4 * j));
+		unsigned int opaque = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, all_ones)) & 0x88888888u;
+		unsigned int clear = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero)) & 0x88888888u;
+		__m256i rgb;
+		if (opaque == 0x88888888u)
+		{
+			rgb = _mm256_shuffle_epi8(v, compact);
+		}
+		else if (clear == 0x88888888u)
+		{
+			rgb = bg_rgb;
+		}
+		else
+		{
+			__m256i halves[2] = { _mm256_unpacklo_epi8(v, zero), _mm256_unpackhi_epi8(v, zero) };
+			for (int h = 0; h < 2; h++)
 			{
-				if (name_in_blocks[i] == chunk.type)
-				{
-					check_inp = 1;
-					if (!go_in_blocks[i])
-					{
-						(*in_blocks)[i] = chunk;
-						go_in_blocks[i] = 1;
-					}
-					else
-					{
-						if (name_in_blocks[i] == tRNS)
-						{
-							char *tmp_in_block;
-							union_two((*in_blocks)[i].length, (*in_blocks)[i].data, chunk.length, chunk.data, &tmp_in_block);
-							free_chunk(chunk);
-							chunk.length = (*in_blocks)[i].length + chunk.length;
-							chunk.data = tmp_in_block;
-						}
-						free_chunk((*in_blocks)[i]);
-						(*in_blocks)[i] = chunk;
-					}
-				}
+				__m256i alpha = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(halves[h], 0xFF), 0xFF);
+				__m256i t = _mm256_add_epi16(_mm256_mullo_epi16(halves[h], alpha), _mm256_mullo_epi16(bg, _mm256_sub_epi16(max, alpha)));
+				t = _mm256_add_epi16(t, bias);
+				halves[h] = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(t, one), _mm256_srli_epi16(t, 8)), 8);
 			}
-			if (check_inp)
+			rgb = _mm256_shuffle_epi8(_mm256_packus_epi16(halves[0], halves[1]), compact);
+		}
+		_mm_storeu_si128((__m128i *)(out + 3 * j), _mm256_castsi256_si128(rgb));
+		_mm_storeu_si128((__m128i *)(out + 3 * j + 12), _mm256_extracti128_si256(rgb, 1));
+	}
+	composite_rgba(in + 4 * j, out + 3 * j, width - j, conversion);
+}
+
+// Four pixels per step, compacted to 12 RGB bytes with one pshufb and stored with a 16-byte
+// store, so the loop keeps two pixels in reserve for the 4 bytes written past the last pixel.
+TARGET_SSSE3 void strip_rgba_ssse3(const unsigned char *in, unsigned char *out, unsigned int width, const struct conversion *conversion)
+{
+	const __m128i compact = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	unsigned int j = 0;
+	for (; j + 6 <= width; j += 4)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + 4 * j));
+		_mm_storeu_si128((__m128i *)(out + 3 * j), _mm_shuffle_epi8(v, compact));
+	}
+	strip_rgba(in + 4 * j, out + 3 * j, width - j, conversion);
+}
+#endif
+
+#if defined(HAVE_NEON)
+int all_zero_neon(uint8x16_t v)
+{
+	uint64x2_t words = vreinterpretq_u64_u8(v);
+	return (vgetq_lane_u64(words, 0) | vgetq_lane_u64(words, 1)) == 0;
+}
+
+void composite_gray_alpha_neon(const unsigned char *in, unsigned char *out, unsigned int width, const struct conversion *conversion)
+{
+	const unsigned char *background = conversion->background;
+	const uint8x8_t bg = vdup_n_u8(background[0]);
+	const uint16x8_t bias = vdupq_n_u16(127);
+	const uint16x8_t one = vdupq_n_u16(1);
+	unsigned int j = 0;
+	for (; j + 16 <= width; j += 16)
+	{
+		uint8x16x2_t v = vld2q_u8(in + 2 * j);
+		uint8x16_t inverse = vmvnq_u8(v.val[1]);
+		if (all_zero_neon(inverse))
+		{
+			vst1q_u8(out + j, v.val[0]);
+			continue;
+		}
+		if (all_zero_neon(v.val[1]))
+		{
+			vst1q_u8(out + j, vdupq_n_u8(background[0]));
+			continue;
+		}
+		uint16x8_t lo = vaddq_u16(vmlal_u8(vmull_u8(vget_low_u8(v.val[0]), vget_low_u8(v.val[1])), bg, vget_low_u8(inverse)), bias);
+		uint16x8_t hi = vaddq_u16(vmlal_u8(vmull_u8(vget_high_u8(v.val[0]), vget_high_u8(v.val[1])), bg, vget_high_u8(inverse)), bias);
+		lo = vshrq_n_u16(vaddq_u16(vaddq_u16(lo, one), vshrq_n_u16(lo, 8)), 8);
+		hi = vshrq_n_u16(vaddq_u16(vaddq_u16(hi, one), vshrq_n_u16(hi, 8)), 8);
+		vst1q_u8(out + j, vcombine_u8(vmovn_u16(lo), vmovn_u16(hi)));
+	}
+	composite_gray_alpha(in + 2 * j, out + j, width - j, conversion);
+}
+
+void composite_rgba_neon(const unsigned char *in, unsigned char *out, unsigned int width, const struct conversion *conversion)
+{
+	const unsigned char *background = conversion->background;
+	const uint16x8_t bias = vdupq_n_u16(127);
+	const uint16x8_t one = vdupq_n_u16(1);
+	unsigned int j = 0;
+	for (; j + 16 <= width; j += 16)
+	{
+		uint8x16x4_t v = vld4q_u8(in + 4 * j);
+		uint8x16_t inverse = vmvnq_u8(v.val[3]);
+		uint8x16x3_t rgb;
+		if (all_zero_neon(inverse) || all_zero_neon(v.val[3]))
+		{
+			int opaque = all_zero_neon(inverse);
+			for (int it = 0; it < 3; it++)
 			{
-				continue;
+				rgb.val[it] = opaque ? v.val[it] : vdupq_n_u8(background[it]);
 			}
+			vst3q_u8(out + 3 * j, rgb);
+			continue;
+		}
+		for (int it = 0; it < 3; it++)
+		{
+			uint8x8_t bg = vdup_n_u8(background[it]);
+			uint16x8_t lo = vaddq_u16(vmlal_u8(vmull_u8(vget_low_u8(v.val[it]), vget_low_u8(v.val[3])), bg, vget_low_u8(inverse)), bias);
+			uint16x8_t hi = vaddq_u16(vmlal_u8(vmull_u8(vget_high_u8(v.val[it]), vget_high_u8(v.val[3])), bg, vget_high_u8(inverse)), bias);
+			lo = vshrq_n_u16(vaddq_u16(vaddq_u16(lo, one), vshrq_n_u16(lo, 8)), 8);
+			hi = vshrq_n_u16(vaddq_u16(vaddq_u16(hi, one), vshrq_n_u16(hi, 8)), 8);
+			rgb.val[it] = vcombine_u8(vmovn_u16(lo), vmovn_u16(hi));
+		}
+		vst3q_u8(out + 3 * j, rgb);
+	}
+	composite_rgba(in + 4 * j, out + 3 * j, width - j, conversion);
+}
+#endif
+
+// ---- PALETTE ----
+// VBMI permutes look up all 256 entries 64 pixels at a time; without it small palettes fit a
+// single pshufb table per channel and larger ones are gathered as RGBX words with AVX2.
+row_kernel select_palette_kernel(const struct palette *palette)
+{
+#if defined(HAVE_X86_DISPATCH)
+	if (cpu_supports(CPU_AVX512_VBMI))
+	{
+		return expand_palette_vbmi;
+	}
+	if (palette->size <= 16 && cpu_supports(CPU_SSSE3))
+	{
+		return expand_palette_ssse3;
+	}
+	if (cpu_supports(CPU_AVX2))
+	{
+		return expand_palette_avx2;
+	}
+#endif
+	return expand_palette;
+}
+
+// Stores each entry as a 4-byte RGBX word, keeping the last pixel for the byte written past it.
+void expand_palette(const unsigned char *in, unsigned char *out, unsigned int width, const struct conversion *conversion)
+{
+	if (width == 0)
+	{
+		return;
+	}
+	for (unsigned int j = 0; j + 1 < width; j++)
+	{
+		memcpy(out + 3 * j, conversion->palette.rgbx[in[j]], 4);
+	}
+	memcpy(out + 3 * (width - 1), conversion->palette.rgbx[in[width - 1]], 3);
+}
+
+#if defined(HAVE_X86_DISPATCH)
+// 16 pixels per step: one pshufb per channel looks the indices up in the 16-entry planes
+// (indices of 16 and more are redirected to zero, matching the black entries past `size`),
+// then RGB_INTERLEAVE packs the three planes into 48 bytes of RGB.
+TARGET_SSSE3 void expand_palette_ssse3(const unsigned char *in, unsigned char *out, unsigned int width, const struct conversion *conversion)
+{
+	__m128i planes[3];
+	__m128i interleave[3][3];
+	for (int c = 0; c < 3; c++)
+	{
+		planes[c] = _mm_loadu_si128((const __m128i *)conversion->palette.planes[c]);
+		for (int n = 0; n < 3; n++)
+		{
+			interleave[n][c] = _mm_loadu_si128((const __m128i *)RGB_INTERLEAVE[n][c]);
 		}
-		free_chunk(chunk);
-	} while (chunk.type != IEND);
+	}
+	const __m128i limit = _mm_set1_epi8(16);
+	unsigned int j = 0;
+	for (; j + 16 <= width; j += 16)
+	{
+		__m128i index = _mm_loadu_si128((const __m128i *)(in + j));
+		index = _mm_or_si128(index, _mm_cmpeq_epi8(_mm_max_epu8(index, limit), index));
+		__m128i colors[3];
+		for (int c = 0; c < 3; c++)
+		{
+			colors[c] = _mm_shuffle_epi8(planes[c], index);
+		}
+		for (int n = 0; n < 3; n++)
+		{
+			__m128i block = _mm_or_si128(
+				_mm_or_si128(_mm_shuffle_epi8(colors[0], interleave[n][0]), _mm_shuffle_epi8(colors[1], interleave[n][1])),
+				_mm_shuffle_epi8(colors[2], interleave[n][2]));
+			_mm_storeu_si128((__m128i *)(out + 3 * j + 16 * n), block);
+		}
+	}
+	expand_palette(in + j, out + 3 * j, width - j, conversion);
+}
 
-end_read:
-	if (return_code != SUCCESS)
+// Gathers eight RGBX words per step and compacts every lane to 12 RGB bytes like composite_rgba_avx2.
+TARGET_AVX2 void expand_palette_avx2(const unsigned char *in, unsigned char *out, unsigned int width, const struct conversion *conversion)
+{
+	const __m256i compact = _mm256_setr_epi8(
+		0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1, 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	unsigned int j = 0;
+	for (; j + 10 <= width; j += 8)
 	{
-		if (*plte_go)
+		__m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(in + j)));
+		__m256i rgbx = _mm256_i32gather_epi32((const int *)conversion->palette.rgbx, index, 4);
+		__m256i rgb = _mm256_shuffle_epi8(rgbx, compact);
+		_mm_storeu_si128((__m128i *)(out + 3 * j), _mm256_castsi256_si128(rgb));
+		_mm_storeu_si128((__m128i *)(out + 3 * j + 12), _mm256_extracti128_si256(rgb, 1));
+	}
+	expand_palette(in + j, out + 3 * j, width - j, conversion);
+}
+
+// 64 pixels per step: every channel plane is looked up with lookup_vbmi, then the planes are
+// interleaved into three 64-byte RGB blocks, R and G with one permute and B merged by a masked one.
+TARGET_AVX512_VBMI void expand_palette_vbmi(const unsigned char *in, unsigned char *out, unsigned int width, const struct conversion *conversion)
+{
+	__m512i tables[3][4];
+	for (int c = 0; c < 3; c++)
+	{
+		for (int t = 0; t < 4; t++)
 		{
-			free_chunk(*plte);
+			tables[c][t] = _mm512_loadu_si512(conversion->palette.planes[c] + 64 * t);
 		}
-		for (int i = 0; i < num_in_blocks; i++)
+	}
+	unsigned char red_green[3][64];
+	unsigned char blue[3][64];
+	__mmask64 blue_mask[3] = { 0, 0, 0 };
+	for (int n = 0; n < 3; n++)
+	{
+		for (int k = 0; k < 64; k++)
 		{
-			if (go_in_blocks[i])
+			int byte = 64 * n + k;
+			red_green[n][k] = (unsigned char)(byte / 3 + (byte % 3 == 1 ? 64 : 0));
+			blue[n][k] = (unsigned char)(byte / 3);
+			if (byte % 3 == 2)
 			{
-				free_chunk(*(in_blocks[i]));
+				blue_mask[n] |= (__mmask64)1 << k;
 			}
 		}
 	}
-	return return_code;
+
+	unsigned int j = 0;
+	for (; j + 64 <= width; j += 64)
+	{
+		__m512i index = _mm512_loadu_si512(in + j);
+		__m512i colors[3];
+		for (int c = 0; c < 3; c++)
+		{
+			colors[c] = lookup_vbmi(tables[c], index);
+		}
+		for (int n = 0; n < 3; n++)
+		{
+			__m512i block = _mm512_permutex2var_epi8(colors[0], _mm512_loadu_si512(red_green[n]), colors[1]);
+			block = _mm512_mask_permutexvar_epi8(block, blue_mask[n], _mm512_loadu_si512(blue[n]), colors[2]);
+			_mm512_storeu_si512(out + 3 * j + 64 * n, block);
+		}
+	}
+	expand_palette(in + j, out + 3 * j, width - j, conversion);
 }
+#endif
 
-int read_chunk(FILE *input, struct chunk *chunk, const unsigned long *crc_table)
+// PAM output of palette images with tRNS: the RGBX entries already hold the alpha.
+row_kernel select_palette_rgba_kernel(void)
 {
-	unsigned int len;
-	char len_inp[4];
-	char type_inp[4];
-	char *data;
-	unsigned int crc1;
-	char crc_inp[4];
-	enum chunk_type type;
+#if defined(HAVE_X86_DISPATCH)
+	if (cpu_supports(CPU_AVX2))
+	{
+		return expand_palette_rgba_avx2;
+	}
+#endif
+	return expand_palette_rgba;
+}
 
-	CHECK_ERROR(SUCCESS, read_nbytes_file(len_inp, 4, input), read_nbytes_file_error_length)
+void expand_palette_rgba(const unsigned char *in, unsigned char *out, unsigned int width, const struct conversion *conversion)
+{
+	for (unsigned int j = 0; j < width; j++)
+	{
+		memcpy(out + 4 * j, conversion->palette.rgbx[in[j]], 4);
+	}
+}
 
-	len = make_int_chars4(len_inp);
+#if defined(HAVE_X86_DISPATCH)
+TARGET_AVX2 void expand_palette_rgba_avx2(const unsigned char *in, unsigned char *out, unsigned int width, const struct conversion *conversion)
+{
+	unsigned int j = 0;
+	for (; j + 8 <= width; j += 8)
+	{
+		__m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(in + j)));
+		_mm256_storeu_si256((__m256i *)(out + 4 * j), _mm256_i32gather_epi32((const int *)conversion->palette.rgbx, index, 4));
+	}
+	expand_palette_rgba(in + j, out + 4 * j, width - j, conversion);
+}
+#endif
 
-	CHECK_ERROR(SUCCESS, read_nbytes_file(type_inp, 4, input), read_nbytes_file_error_type)
-	type = change_type_chunk(type_inp);
+// ---- GRAY ----
+// Only keys that fit the 8-bit range can match; sub-byte keys were already rescaled.
+void make_gray_table(struct chunk trns, unsigned char background, struct gray_table *table)
+{
+	for (int v = 0; v < 256; v++)
+	{
+		table->map[v] = (unsigned char)v;
+		table->alpha[v] = 255;
+	}
+	for (unsigned int ti = 0; ti + 1 < trns.length; ti += 2)
+	{
+		if (ARR(trns.data, ti / 2, 0, 2) == 0)
+		{
+			table->map[(unsigned char)ARR(trns.data, ti / 2, 1, 2)] = background;
+			table->alpha[(unsigned char)ARR(trns.data, ti / 2, 1, 2)] = 0;
+		}
+	}
+	list_changed_gray(table);
+}
 
-	CHECK_ERROR(SUCCESS, allocate_vector(len, &data), alloc_vec)
-	CHECK_ERROR_WITH_FREE(SUCCESS, read_nbytes_file(data, len, input), read_nbytes_file_error_data, free(data))
+void list_changed_gray(struct gray_table *table)
+{
+	table->changed_count = 0;
+	for (int v = 0; v < 256; v++)
+	{
+		if (table->map[v] != v)
+		{
+			table->changed[table->changed_count++] = (unsigned char)v;
+		}
+	}
+}
 
-	CHECK_ERROR_WITH_FREE(SUCCESS, read_nbytes_file(crc_inp, 4, input), read_nbytes_file_error_crc, free(data))
+// VBMI looks up the whole table 64 pixels at a time. Otherwise, as the table is the identity
+// apart from the few tRNS keys, SSE2 compares against each key and selects the background.
+row_kernel select_gray_kernel(const struct gray_table *table)
+{
+#if defined(HAVE_X86_DISPATCH)
+	if (cpu_supports(CPU_AVX512_VBMI))
+	{
+		return map_gray_vbmi;
+	}
+#endif
+#if defined(HAVE_SSE2)
+	if (table->changed_count <= GRAY_SELECT_MAX_KEYS)
+	{
+		return map_gray_sse2;
+	}
+#endif
+	return map_gray;
+}
 
-	crc1 = make_int_chars4(crc_inp);
-	unsigned int crc2;
-	CHECK_ERROR_WITH_FREE(SUCCESS, crc(&crc2, crc_table, (unsigned char *)type_inp, (unsigned char *)data, len), crc_compute, free(data))
-	if (crc1 != crc2 && type < 3)
+void map_gray(const unsigned char *in, unsigned char *out, unsigned int width, const struct conversion *conversion)
+{
+	for (unsigned int j = 0; j < width; j++)
 	{
-		fprintf(stderr, "No good crc for main chunk.\n");
-		free(data);
-		return ERROR_DATA_INVALID;
+		out[j] = conversion->gray.map[in[j]];
 	}
+}
 
-	chunk->length = len;
-	chunk->type = type;
-	chunk->data = data;
+#if defined(HAVE_SSE2)
+void map_gray_sse2(const unsigned char *in, unsigned char *out, unsigned int width, const struct conversion *conversion)
+{
+	__m128i keys[GRAY_SELECT_MAX_KEYS];
+	__m128i replace[GRAY_SELECT_MAX_KEYS];
+	for (unsigned int k = 0; k < conversion->gray.changed_count; k++)
+	{
+		keys[k] = _mm_set1_epi8((char)conversion->gray.changed[k]);
+		replace[k] = _mm_set1_epi8((char)conversion->gray.map[conversion->gray.changed[k]]);
+	}
+	unsigned int j = 0;
+	for (; j + 16 <= width; j += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + j));
+		__m128i result = v;
+		for (unsigned int k = 0; k < conversion->gray.changed_count; k++)
+		{
+			__m128i match = _mm_cmpeq_epi8(v, keys[k]);
+			result = _mm_or_si128(_mm_andnot_si128(match, result), _mm_and_si128(match, replace[k]));
+		}
+		_mm_storeu_si128((__m128i *)(out + j), result);
+	}
+	map_gray(in + j, out + j, width - j, conversion);
+}
+#endif
 
-	return SUCCESS;
+#if defined(HAVE_X86_DISPATCH)
+// Looks 64 bytes up in a 256-entry table held in four registers: two permutes cover the low and
+// high 128 entries and the index sign bit picks between them.
+TARGET_AVX512_VBMI __m512i lookup_vbmi(const __m512i table[4], __m512i index)
+{
+	__m512i low_half = _mm512_permutex2var_epi8(table[0], index, table[1]);
+	__m512i high_half = _mm512_permutex2var_epi8(table[2], index, table[3]);
+	return _mm512_mask_blend_epi8(_mm512_movepi8_mask(index), low_half, high_half);
 }
 
-enum chunk_type change_type_chunk(char inp[4])
+TARGET_AVX512_VBMI void map_gray_vbmi(const unsigned char *in, unsigned char *out, unsigned int width, const struct conversion *conversion)
 {
-	for (int i = 0; i < COUNT_CHUNK_TYPES - 1; i++)
+	__m512i map[4];
+	for (int t = 0; t < 4; t++)
 	{
-		if (check_equal_array(4, inp, PNG_CHUNKS_SIGNATURE[i]))
+		map[t] = _mm512_loadu_si512(conversion->gray.map + 64 * t);
+	}
+	unsigned int j = 0;
+	for (; j + 64 <= width; j += 64)
+	{
+		_mm512_storeu_si512(out + j, lookup_vbmi(map, _mm512_loadu_si512(in + j)));
+	}
+	map_gray(in + j, out + j, width - j, conversion);
+}
+#endif
+
+// PAM output of gray images with tRNS: every value is followed by its alpha.
+void expand_gray_key(const unsigned char *in, unsigned char *out, unsigned int width, const struct conversion *conversion)
+{
+	for (unsigned int j = 0; j < width; j++)
+	{
+		unsigned char value = in[j];
+		out[2 * j] = value;
+		out[2 * j + 1] = conversion->gray.alpha[value];
+	}
+}
+
+// ---- COLOR KEY ----
+void make_color_keys(struct chunk trns, struct color_keys *keys)
+{
+	keys->count = 0;
+	for (unsigned int ti = 0; ti + 6 <= trns.length && keys->count < MAX_COLOR_KEYS; ti += 6)
+	{
+		if (trns.data[ti] == 0 && trns.data[ti + 2] == 0 && trns.data[ti + 4] == 0)
 		{
-			return (enum chunk_type)i;
+			keys->keys[keys->count][0] = trns.data[ti + 1];
+			keys->keys[keys->count][1] = trns.data[ti + 3];
+			keys->keys[keys->count][2] = trns.data[ti + 5];
+			keys->count++;
 		}
 	}
-	return ANOTHER;
 }
 
-void unfilter_png(unsigned int width, unsigned int height, int bytes_pixel, char *png_data)
+// The spec allows a single key, which gets the vector kernel; anything else is handled by the
+// generic scalar loop.
+row_kernel select_color_key_kernel(const struct color_keys *keys)
 {
-	unsigned long delm = width * bytes_pixel + 1;
-
-	for (int i = 0; i < height; i++)
+#if defined(HAVE_SSE2)
+	if (keys->count == 1)
 	{
-		enum filter_type filter = (enum filter_type)ARR(png_data, i, 0, delm);
+		return replace_color_key_sse2;
+	}
+#endif
+	return replace_color_keys;
+}
 
-		if (filter == NONE)
-			continue;
-		for (int j = 1; j < width * bytes_pixel + 1; j++)
+void replace_color_keys(const unsigned char *in, unsigned char *out, unsigned int width, const struct conversion *conversion)
+{
+	for (unsigned int j = 0; j < width; j++)
+	{
+		const unsigned char *pixel = in + 3 * j;
+		const unsigned char *value = pixel;
+		for (unsigned int k = 0; k < conversion->keys.count; k++)
 		{
-			unsigned char a_byte = (j - bytes_pixel >= 1 ? ARR(png_data, i, j - bytes_pixel, delm) : 0);
-			unsigned char b_byte = (i - 1 >= 0 ? ARR(png_data, i - 1, j, delm) : 0);
-			unsigned char c_byte = (i - 1 >= 0 && j - bytes_pixel >= 1 ? ARR(png_data, i - 1, j - bytes_pixel, delm) : 0);
-			if (filter == SUB)
-			{
-				ARR(png_data, i, j, delm) += a_byte;
-			}
-			else if (filter == UP)
+			if (memcmp(pixel, conversion->keys.keys[k], 3) == 0)
 			{
-				ARR(png_data, i, j, delm) += b_byte;
+				value = conversion->background;
+				break;
 			}
-			else if (filter == AVERAGE)
+		}
+		memmove(out + 3 * j, value, 3);
+	}
+}
+
+#if defined(HAVE_SSE2)
+// 16 pixels (three vectors) per step: bytes are compared with the key repeated in the phase of
+// each vector, the 48 match bits are reduced to pixels whose three bytes all match, spread back
+// over those bytes and used to select the background.
+void replace_color_key_sse2(const unsigned char *in, unsigned char *out, unsigned int width, const struct conversion *conversion)
+{
+	const unsigned long long pixel_starts = 0x249249249249ULL;
+	unsigned char pattern[2][48];
+	for (int b = 0; b < 48; b++)
+	{
+		pattern[0][b] = conversion->keys.keys[0][b % 3];
+		pattern[1][b] = conversion->background[b % 3];
+	}
+	__m128i key[3];
+	__m128i background[3];
+	for (int n = 0; n < 3; n++)
+	{
+		key[n] = _mm_loadu_si128((const __m128i *)(pattern[0] + 16 * n));
+		background[n] = _mm_loadu_si128((const __m128i *)(pattern[1] + 16 * n));
+	}
+	const __m128i bit_select = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+
+	unsigned int j = 0;
+	for (; j + 16 <= width; j += 16)
+	{
+		__m128i v[3];
+		unsigned long long match = 0;
+		for (int n = 0; n < 3; n++)
+		{
+			v[n] = _mm_loadu_si128((const __m128i *)(in + 3 * j + 16 * n));
+			match |= (unsigned long long)_mm_movemask_epi8(_mm_cmpeq_epi8(v[n], key[n])) << (16 * n);
+		}
+		match &= (match >> 1) & (match >> 2) & pixel_starts;
+		match |= (match << 1) | (match << 2);
+		for (int n = 0; n < 3; n++)
+		{
+			unsigned int bits = (unsigned int)(match >> (16 * n)) & 0xFFFF;
+			if (bits != 0)
 			{
-				ARR(png_data, i, j, delm) += floor(((double)a_byte + (double)b_byte) / 2.0);
+				__m128i spread = _mm_unpacklo_epi64(_mm_set1_epi8((char)(bits & 0xFF)), _mm_set1_epi8((char)(bits >> 8)));
+				__m128i mask = _mm_cmpeq_epi8(_mm_and_si128(spread, bit_select), bit_select);
+				v[n] = _mm_or_si128(_mm_andnot_si128(mask, v[n]), _mm_and_si128(mask, background[n]));
 			}
-			else if (filter == PAETH)
+			_mm_storeu_si128((__m128i *)(out + 3 * j + 16 * n), v[n]);
+		}
+	}
+	replace_color_keys(in + 3 * j, out + 3 * j, width - j, conversion);
+}
+#endif
+
+// PAM output of RGB images with tRNS: pixels matching a key get alpha 0, all others 255.
+void expand_color_keys(const unsigned char *in, unsigned char *out, unsigned int width, const struct conversion *conversion)
+{
+	for (unsigned int j = 0; j < width; j++)
+	{
+		const unsigned char *pixel = in + 3 * j;
+		unsigned char alpha = 255;
+		for (unsigned int k = 0; k < conversion->keys.count; k++)
+		{
+			if (memcmp(pixel, conversion->keys.keys[k], 3) == 0)
 			{
-				int p_byte = (int)a_byte + (int)b_byte - (int)c_byte;
-				int pa = abs(p_byte - (int)a_byte);
-				int pb = abs(p_byte - (int)b_byte);
-				int pc = abs(p_byte - (int)c_byte);
-				unsigned char rec;
-				if (pa <= pb && pa <= pc)
-				{
-					rec = a_byte;
-				}
-				else if (pb <= pc)
-				{
-					rec = b_byte;
-				}
-				else
-				{
-					rec = c_byte;
-				}
-				ARR(png_data, i, j, delm) += rec;
+				alpha = 0;
+				break;
 			}
 		}
+		memmove(out + 4 * j, pixel, 3);
+		out[4 * j + 3] = alpha;
 	}
 }
 
@@ -846,6 +5079,143 @@ int union_two(unsigned long a_len, const char *a, unsigned long b_len, const cha
 	return SUCCESS;
 }
 
+unsigned long packed_row_bytes(unsigned int width, int bits_pixel)
+{
+	return ((unsigned long)width * bits_pixel + 7) / 8;
+}
+
+// Size of `height` rows of `bits_pixel`-bit pixels, each row prefixed with its filter byte.
+unsigned long image_data_size(unsigned int width, unsigned int height, int bits_pixel)
+{
+	return (unsigned long)height * (packed_row_bytes(width, bits_pixel) + 1);
+}
+
+// Whether the output rows (and a header) stay within the int positions they are tracked with;
+// `element_size` is 4 for float32 tensors. Reports the image as too large when they do not.
+int output_fits(unsigned int width, unsigned int height, int bytes_pixel_out, int element_size)
+{
+	unsigned long long size = (unsigned long long)width * height * bytes_pixel_out * element_size;
+	if (size > (unsigned long long)(INT_MAX - MAX_HEADER))
+	{
+		fprintf(stderr, "Image %ux%u is too large: its output needs %llu bytes.\n", width, height, size);
+		return 0;
+	}
+	return 1;
+}
+
+unsigned long adam7_data_size(unsigned int width, unsigned int height, int bits_pixel, int passes)
+{
+	unsigned long size = 0;
+	for (int p = 0; p < passes; p++)
+	{
+		unsigned int pass_width = adam7_pass_width(width, p);
+		unsigned int pass_height = adam7_pass_height(height, p);
+		if (pass_width != 0 && pass_height != 0)
+		{
+			size += image_data_size(pass_width, pass_height, bits_pixel);
+		}
+	}
+	return size;
+}
+
+unsigned int adam7_pass_width(unsigned int width, int pass)
+{
+	return width > ADAM7_X0[pass] ? (width - ADAM7_X0[pass] + ADAM7_DX[pass] - 1) / ADAM7_DX[pass] : 0;
+}
+
+unsigned int adam7_pass_height(unsigned int height, int pass)
+{
+	return height > ADAM7_Y0[pass] ? (height - ADAM7_Y0[pass] + ADAM7_DY[pass] - 1) / ADAM7_DY[pass] : 0;
+}
+
+// ---- THREADS ----
+#if defined(_WIN32)
+unsigned __stdcall task_trampoline(void *arg)
+{
+	struct thread_task *task = arg;
+	task->func(task->arg);
+	return 0;
+}
+#endif
+
+int start_task(struct thread_task *task)
+{
+#if defined(_WIN32)
+	task->handle = (HANDLE)_beginthreadex(NULL, 0, task_trampoline, task, 0, NULL);
+	return task->handle != 0 ? SUCCESS : ERROR_UNKNOWN;
+#else
+	return pthread_create(&task->handle, NULL, task->func, task->arg) == 0 ? SUCCESS : ERROR_UNKNOWN;
+#endif
+}
+
+void join_task(struct thread_task *task)
+{
+#if defined(_WIN32)
+	WaitForSingleObject(task->handle, INFINITE);
+	CloseHandle(task->handle);
+#else
+	pthread_join(task->handle, NULL);
+#endif
+}
+
+void init_signal(struct task_signal *signal)
+{
+#if defined(_WIN32)
+	InitializeCriticalSection(&signal->lock);
+	InitializeConditionVariable(&signal->changed);
+#else
+	pthread_mutex_init(&signal->lock, NULL);
+	pthread_cond_init(&signal->changed, NULL);
+#endif
+}
+
+void destroy_signal(struct task_signal *signal)
+{
+#if defined(_WIN32)
+	DeleteCriticalSection(&signal->lock);
+#else
+	pthread_cond_destroy(&signal->changed);
+	pthread_mutex_destroy(&signal->lock);
+#endif
+}
+
+void lock_signal(struct task_signal *signal)
+{
+#if defined(_WIN32)
+	EnterCriticalSection(&signal->lock);
+#else
+	pthread_mutex_lock(&signal->lock);
+#endif
+}
+
+void unlock_signal(struct task_signal *signal)
+{
+#if defined(_WIN32)
+	LeaveCriticalSection(&signal->lock);
+#else
+	pthread_mutex_unlock(&signal->lock);
+#endif
+}
+
+// Waits for notify_signal; the lock must be held and is held again on return.
+void wait_signal(struct task_signal *signal)
+{
+#if defined(_WIN32)
+	SleepConditionVariableCS(&signal->changed, &signal->lock, INFINITE);
+#else
+	pthread_cond_wait(&signal->changed, &signal->lock);
+#endif
+}
+
+void notify_signal(struct task_signal *signal)
+{
+#if defined(_WIN32)
+	WakeAllConditionVariable(&signal->changed);
+#else
+	pthread_cond_broadcast(&signal->changed);
+#endif
+}
+
 // ---- CRC ----
 void make_crc_table(unsigned long *crc_table)
 {
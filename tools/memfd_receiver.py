@@ -0,0 +1,73 @@
+#!/usr/bin/env python3
+"""Receiver side of --memfd, used to check a build.
+
+    memfd_receiver.py BINARY input.png [R/X G B]
+
+Converts input.png once to a regular file and once with --memfd for each kind of TARGET: a Unix
+socket path the receiver listens on, and fd:N for an inherited socket. Every received descriptor
+must hold exactly the file's bytes and be sealed against writes and resizing. Exits with 1 on the
+first mismatch. Linux only (memfd_create, F_GET_SEALS); needs Python 3.9+ for socket.recv_fds.
+"""
+
+import fcntl
+import os
+import socket
+import subprocess
+import sys
+import tempfile
+
+def receive(conn):
+    message, fds, _, _ = socket.recv_fds(conn, 1, 1)
+    if message != b"P" or len(fds) != 1:
+        raise SystemExit("unexpected message %r with %d descriptors" % (message, len(fds)))
+    return fds[0]
+
+
+def check(kind, fd, expected):
+    data = os.pread(fd, os.fstat(fd).st_size + 1, 0)
+    seals = fcntl.fcntl(fd, fcntl.F_GET_SEALS)
+    os.close(fd)
+    required = fcntl.F_SEAL_SHRINK | fcntl.F_SEAL_GROW | fcntl.F_SEAL_WRITE
+    if data != expected:
+        raise SystemExit("%s: received %d bytes that differ from the %d-byte file output" % (kind, len(data), len(expected)))
+    if seals & required != required:
+        raise SystemExit("%s: descriptor seals are %#x, expected at least %#x" % (kind, seals, required))
+    print("%s: %d bytes match, seals %#x" % (kind, len(data), seals))
+
+
+def main():
+    if len(sys.argv) < 3:
+        raise SystemExit(__doc__)
+    binary, source, extra = sys.argv[1], sys.argv[2], sys.argv[3:]
+    with tempfile.TemporaryDirectory() as work:
+        output = os.path.join(work, "out.pnm")
+        subprocess.run([binary, source, output] + extra, check=True)
+        with open(output, "rb") as f:
+            expected = f.read()
+
+        # TARGET is a socket path: the converter connects to us
+        path = os.path.join(work, "memfd.sock")
+        with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as server:
+            server.bind(path)
+            server.listen(1)
+            process = subprocess.Popen([binary, "--memfd", path, source, "unused"] + extra)
+            conn, _ = server.accept()
+            with conn:
+                fd = receive(conn)
+            if process.wait() != 0:
+                raise SystemExit("socket path: converter exited with %d" % process.returncode)
+            check("socket path", fd, expected)
+
+        # TARGET is fd:N: the converter inherits one end of a socket pair
+        ours, theirs = socket.socketpair()
+        with ours:
+            process = subprocess.Popen([binary, "--memfd", "fd:%d" % theirs.fileno(), source, "unused"] + extra, pass_fds=[theirs.fileno()])
+            theirs.close()
+            fd = receive(ours)
+            if process.wait() != 0:
+                raise SystemExit("inherited fd: converter exited with %d" % process.returncode)
+            check("inherited fd", fd, expected)
+
+
+if __name__ == "__main__":
+    main()
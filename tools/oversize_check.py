@@ -0,0 +1,53 @@
+#!/usr/bin/env python3
+"""Checks that images whose output does not fit are rejected rather than converted.
+
+    oversize_check.py BINARY
+
+Writes a PNG whose header declares a 20000x20000 RGB image (1.2 GB of 8-bit samples, 4.8 GB as a
+float32 tensor) and runs --npy --float32 on it: the converter must fail with "too large" before
+decompressing and leave no output. A 1x1 image with the same options must still convert.
+"""
+
+import os
+import struct
+import subprocess
+import sys
+import tempfile
+import zlib
+
+
+def chunk(kind, data):
+    return struct.pack(">I", len(data)) + kind + data + struct.pack(">I", zlib.crc32(kind + data))
+
+
+def png(width, height):
+    ihdr = struct.pack(">IIBBBBB", width, height, 8, 2, 0, 0, 0)
+    rows = zlib.compress(b"\0\1\2\3" * (width == 1 and height == 1))
+    return b"\x89PNG\r\n\x1a\n" + chunk(b"IHDR", ihdr) + chunk(b"IDAT", rows) + chunk(b"IEND", b"")
+
+
+def run(binary, work, width, height):
+    source = os.path.join(work, "in_%dx%d.png" % (width, height))
+    output = os.path.join(work, "out_%dx%d.npy" % (width, height))
+    with open(source, "wb") as f:
+        f.write(png(width, height))
+    result = subprocess.run([binary, "--npy", "hwc", "--float32", source, output], capture_output=True, text=True)
+    return result, os.path.exists(output)
+
+
+def main():
+    if len(sys.argv) != 2:
+        raise SystemExit(__doc__)
+    with tempfile.TemporaryDirectory() as work:
+        result, written = run(sys.argv[1], work, 20000, 20000)
+        if result.returncode == 0 or written or "too large" not in result.stderr:
+            raise SystemExit("20000x20000: exit %d, output %s, stderr %r" % (result.returncode, "written" if written else "absent", result.stderr))
+        print("20000x20000: rejected (%s)" % result.stderr.strip())
+        result, written = run(sys.argv[1], work, 1, 1)
+        if result.returncode != 0 or not written:
+            raise SystemExit("1x1: exit %d, stderr %r" % (result.returncode, result.stderr))
+        print("1x1: converted")
+
+
+if __name__ == "__main__":
+    main()